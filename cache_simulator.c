@@ -1,192 +1,4957 @@
 /**
  * @file cache_simulator.c
  *
- * @brief Implementation of a cache simulator. The simulator is implemented 
- *        with doubly linked list to keep track of the LRU.
+ * @brief Implementation of a cache simulator. Every set is a fixed block of
+ *        ways allocated once at startup, and an index-linked queue inside
+ *        the set keeps track of the LRU.
+ *        The -j mode runs worker threads, so the simulator is built
+ *        with -pthread, and linked with -lm.
  * @author Wenqi Deng <wenqid@andrew.cmu.edu>
  */
 
 #include "cachelab.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
 #define ADDRESS_BITS 64
 
-/* Represent each line using a struct */
+#if defined(__GNUC__) || defined(__clang__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/* Bits kept per way in queue_set_t.flags */
+#define LINE_VALID 0x1 /* whether the line is valid */
+#define LINE_DIRTY 0x2 /* whether the line is modified */
+#define LINE_EXCLUSIVE 0x4 /* whether no other core holds the line, for -C */
+#define LINE_PREFETCHED 0x8 /* filled by a prefetch, not yet used */
+
+/* Write policy bits of cache_options_t.write, 0 for write-back with
+ * write-allocate */
+#define WRITE_THROUGH 0x1     /* stores go to the next level, lines stay
+                                 clean */
+#define WRITE_NO_ALLOCATE 0x2 /* a store miss goes to the next level only */
+
+/* Largest associativity of the age and matrix LRU engines */
+#define AGE_MAX_WAYS 16
+#define MATRIX_MAX_WAYS 8
+/* Associativity above which the hash engine is picked automatically */
+#define HASH_MIN_WAYS 128
+
+/** How the LRU order of a set is tracked, selected with -e
+ *  ENGINE_LIST     index-linked queue from head (MRU) to tail (LRU)
+ *  ENGINE_AGE      one age byte per way, 0 is the MRU and E-1 the LRU
+ *  ENGINE_MATRIX   8x8 bit matrix, row i has bit j set if way i was used
+ *                  more recently than way j; the LRU way has an empty row
+ *  ENGINE_DIRECT   direct-mapped cache (E = 1) without sets: a flat tag
+ *                  array indexed by set number and valid/dirty bitsets
+ *  ENGINE_HASH     index-linked queue as ENGINE_LIST, with an open
+ *                  addressing table from (set, tag) to way so that highly
+ *                  associative caches find their way in O(1)
+ */
+typedef enum {
+    ENGINE_AUTO,
+    ENGINE_LIST,
+    ENGINE_AGE,
+    ENGINE_MATRIX,
+    ENGINE_DIRECT,
+    ENGINE_HASH
+} lru_engine_t;
+
+/** Which way is evicted from a full set, selected with -p. LRU runs on the
+ *  engines above; every other policy keeps one word of state per way in
+ *  queue_set_t.meta and finds its ways by scanning the tags.
+ *  POLICY_LRU      least recently used way
+ *  POLICY_FIFO     oldest way: a fill stamps its way with a count of the
+ *                  fills of the set, so a way refilled out of order, after
+ *                  an invalidation, still waits its turn
+ *  POLICY_RANDOM   uniformly random way, from a xoshiro256** generator
+ *                  seeded with -r
+ *  POLICY_LFU      way with the fewest accesses since it was filled, the
+ *                  lowest way on a tie
+ *  POLICY_NRU      lowest way whose reference bit is clear; when every bit
+ *                  is set they are all cleared and way 0 is evicted
+ *  POLICY_PLRU     tree pseudo-LRU: E-1 bits in queue_set_t.state form a
+ *                  binary tree over the ways, each pointing at the half
+ *                  that was used less recently (E a power of two <= 64)
+ *  POLICY_SRRIP    static re-reference interval prediction: a way has an
+ *                  RRPV of -w bits, 0 on a hit and max-1 when filled; the
+ *                  victim is the lowest way at max, after every RRPV of the
+ *                  set was raised by the distance of its largest to max
+ *  POLICY_BRRIP    bimodal RRIP: as SRRIP, filling at max except once every
+ *                  BRRIP_LONG_ODDS fills, at random
+ *  POLICY_DRRIP    dynamic RRIP: leader sets always use SRRIP or BRRIP and
+ *                  count their misses in a PSEL counter, the other sets
+ *                  follow whichever of the two misses less; a single set
+ *                  leaves no room for leaders and runs SRRIP
+ *  POLICY_OPT      Belady's optimal policy: the way used again furthest in
+ *                  the future, from next-use positions computed by a first
+ *                  pass over the trace
+ *  POLICY_HAWKEYE  Hawkeye: OPTgen replays OPT on a few sampled sets and
+ *                  trains a predictor indexed by a hash of the address
+ *                  region (the trace has no PC); lines predicted
+ *                  cache-friendly are kept with RRIP aging, cache-averse
+ *                  ones are inserted as the next victims
+ *  POLICY_ARC      adaptive replacement cache: recency list T1 and
+ *                  frequency list T2, with ghost lists B1 and B2 of
+ *                  evicted blocks steering the target size of T1
+ *  POLICY_LIRS     low inter-reference recency set: LIR blocks are kept,
+ *                  resident HIR blocks queue up for eviction, and a HIR
+ *                  block reused within the recency of the LIR set (still
+ *                  in the stack, resident or not) becomes LIR
+ *  ARC and LIRS keep 2E entries per set, the ghosts included, in nodes
+ *  linked by index and found through the hash table of ENGINE_HASH.
+ */
+typedef enum {
+    POLICY_LRU,
+    POLICY_FIFO,
+    POLICY_RANDOM,
+    POLICY_LFU,
+    POLICY_NRU,
+    POLICY_PLRU,
+    POLICY_SRRIP,
+    POLICY_BRRIP,
+    POLICY_DRRIP,
+    POLICY_OPT,
+    POLICY_HAWKEYE,
+    POLICY_ARC,
+    POLICY_LIRS
+} replacement_policy_t;
+
+/** Prefetcher watching the demand accesses, selected with -P. A trigger is
+ *  a demand miss or the first hit on a prefetched line; -D gives the
+ *  number of blocks fetched ahead.
+ *  PREFETCH_NONE     no prefetching
+ *  PREFETCH_NEXT     next-N-line: a trigger fetches the N next blocks
+ *  PREFETCH_STRIDE   a table indexed by the address region (the trace has
+ *                    no PC) learns the stride between the accesses of a
+ *                    region and, once confident, fetches along it
+ *  PREFETCH_STREAM   stream buffers: a trigger next to the head of a
+ *                    stream advances it and keeps the blocks up to the
+ *                    depth ahead fetched; other triggers start a stream
+ */
+typedef enum {
+    PREFETCH_NONE,
+    PREFETCH_NEXT,
+    PREFETCH_STRIDE,
+    PREFETCH_STREAM
+} prefetch_t;
+
+/* Largest associativity of POLICY_PLRU, whose tree fits in one word */
+#define PLRU_MAX_WAYS 64
+
+/* BRRIP fills at max-1 once in this many fills */
+#define BRRIP_LONG_ODDS 32
+/* Number of leader sets of each of SRRIP and BRRIP under DRRIP */
+#define DRRIP_LEADERS 32
+/* Width of the DRRIP PSEL counter, followers use BRRIP in its upper half */
+#define PSEL_BITS 10
+/* Role of a set under DRRIP, kept in queue_set_t.state */
+#define LEADER_SRRIP 1
+#define LEADER_BRRIP 2
+
+/* Next-use position of a block that is never used again */
+#define NEXT_USE_NEVER ((uint64_t)INT64_MAX)
+
+/* Hawkeye: number of sets replayed by OPTgen, length of their history in
+ * accesses per way, predictor entries and counter range, bits of address
+ * in a region sharing a signature, and the RRPV range */
+#define HAWKEYE_SAMPLED_SETS 64
+#define HAWKEYE_HISTORY 8
+#define HAWKEYE_PREDICTOR_BITS 11
+#define HAWKEYE_COUNTER_MAX 7
+#define HAWKEYE_REGION_BITS 12
+#define HAWKEYE_RRPV_MAX 7
+
+/* Lists of ARC entries, and of LIRS entries: the LIRS stack links through
+ * queue_set_t.prev/next, the queue of resident HIR blocks and the FIFO of
+ * non-resident ones through qprev/qnext */
+enum { ARC_T1, ARC_T2, ARC_B1, ARC_B2, ARC_LISTS };
+enum { LIRS_STACK = 0, LIRS_QUEUE = 1, LIRS_GHOSTS = 2 };
+/* Status of a LIRS entry in queue_set_t.meta */
+#define LIRS_LIR 0x1      /* low inter-reference recency, resident */
+#define LIRS_IN_STACK 0x2 /* the entry is in the stack */
+/* Share of the ways of a set kept for resident HIR blocks, in percent */
+#define LIRS_HIR_PERCENT 1
+
+/** An index-linked list of entries, from head (MRU) to tail (LRU) */
+typedef struct {
+    int head;
+    int tail;
+    int size;
+} node_list_t;
+
+/** Options of a cache besides its geometry */
+typedef struct {
+    lru_engine_t engine;         /* LRU engine, ENGINE_AUTO to pick from E */
+    replacement_policy_t policy; /* replacement policy */
+    uint64_t seed;               /* seed of the POLICY_RANDOM generator */
+    int rrpv_bits;               /* width of an RRPV under the RRIP family */
+    int write;                   /* WRITE_THROUGH / WRITE_NO_ALLOCATE */
+    prefetch_t prefetch;         /* prefetcher of the cache */
+    int prefetch_degree;         /* blocks fetched ahead, 0 for default */
+} cache_options_t;
+
+/** A set is a fixed block of E ways carved out of one allocation made at
+ *  startup. Tags, valid/dirty bits and the LRU state are stored as separate
+ *  dense arrays so that the hit check only walks the tags of the set. Only
+ *  the LRU state of the selected engine is allocated: the list engine links
+ *  ways by index instead of pointers to heap nodes, the age engine keeps
+ *  AGE_MAX_WAYS bytes per set so they fit one vector, and the matrix engine
+ *  needs no per-way storage at all.
+ */
+typedef struct queue_set {
+    unsigned long *tag;   /* tags of the E ways */
+    unsigned char *flags; /* LINE_VALID / LINE_DIRTY / ... of the E ways */
+    int *prev;            /* way used just after this one, -1 for the head */
+    int *next;            /* way used just before this one, -1 for the tail */
+    unsigned char *age;   /* recency rank of each way, for ENGINE_AGE */
+    unsigned long matrix; /* LRU bit matrix, for ENGINE_MATRIX */
+    uint32_t *meta;       /* per-way state of a policy other than LRU */
+    unsigned char *rrpv;  /* E re-reference predictions, for the RRIP family */
+    uint64_t *next_use;   /* next-use position of each way, for POLICY_OPT */
+    int *qprev;           /* second links of the LIRS entries */
+    int *qnext;
+    node_list_t *lists;   /* ARC_LISTS lists of entries, for ARC and LIRS */
+    int target;           /* ARC target size of T1, LIRS number of LIRs */
+    int free_node;        /* first entry of the free list, -1 if empty */
+    int holes;            /* ways invalidated from below, for policies
+                             other than LRU, filled before evicting */
+    uint64_t state;       /* per-set state of a policy other than LRU */
+    int head;             /* most recently used way, -1 if the set is empty */
+    int tail;             /* least recently used way, -1 if the set is empty */
+    int curr_line_num;    /* current number of valid ways in the set */
+} queue_set_t;
+
+/** One access of the trace. Records are decoded in batches and handed to
+ *  the simulation kernel of the cache. The layout is also the record of
+ *  the binary trace format: a little-endian address word followed by a
+ *  word holding the size in bits 0-31, the op in bits 32-39 and the core
+ *  in bits 40-47, so on a little-endian host a mapped binary trace is used
+ *  without copying. Traces written before the core existed hold 0 there.
+ */
+typedef struct {
+    uint64_t address; /* address of the access */
+    uint32_t size;    /* number of bytes accessed */
+    uint8_t op;       /* 'L' for a load, 'S' for a store */
+    uint8_t core;     /* core or thread making the access */
+    uint8_t pad[2];
+} trace_record_t;
+
+_Static_assert(sizeof(trace_record_t) == 16, "binary records are 16 bytes");
+
+/** Header of a binary trace, followed by count records */
+typedef struct {
+    char magic[8];        /* TRACE_MAGIC */
+    uint32_t version;     /* TRACE_VERSION */
+    uint32_t record_size; /* sizeof(trace_record_t) */
+    uint64_t count;       /* number of records */
+    uint64_t reserved;    /* 0, keeps the records 16-byte aligned */
+} trace_header_t;
+
+#define TRACE_MAGIC "CSIMTRC\0"
+#define TRACE_VERSION 1
+
+/* Number of records decoded before the kernel is called */
+#define RECORD_BATCH 4096
+
+struct cache;
+
+/* Simulates a batch of records against a cache */
+typedef void (*sim_kernel_t)(struct cache *cache, const trace_record_t *rec,
+                             size_t n);
+
+/** OPTgen state of a set sampled by Hawkeye. The last accesses to the set
+ *  are kept as a history of blocks; the occupancy vector counts, for each
+ *  of the last window accesses, how many lines OPT keeps cached across
+ *  it. A reuse is an OPT hit if the cache had room all the way from the
+ *  previous access.
+ */
+typedef struct {
+    unsigned long *block;  /* block of each history entry */
+    unsigned char *valid;  /* LINE_VALID of each entry, for match_tag */
+    uint64_t *time;        /* set access count at the entry's last access */
+    uint32_t *sig;         /* signature of the entry's last access */
+    uint32_t *occupancy;   /* lines kept by OPT, by access count % window */
+    uint64_t clock;        /* number of accesses to the set */
+    int used;              /* number of valid entries */
+} sampled_set_t;
+
+/** The cache and its counters
+ *  hit: count number of hits.
+ *  miss: count number of misses.
+ *  eviction: count number of evictions.
+ *  dirty_count: count number of lines which the dirty bit is set to 1.
+ *  dirty_eviction: count number of evictions that the dirty bit is set to 1.
+ *  s   number of set bits
+ *  S   number of set, can be calculated by S = 2^s
+ *  b   number of bits that represent byte offset
+ *  B   number of bytes in a block, can be calculated by B = 2^b
+ *  t   number of tag bits, t = 64 - s - b
+ *  E   number of line per set
+ */
+typedef struct cache {
+    int s, E, b, S, B, t;
+    int nodes; /* entries per set: E, or 2E with the ARC and LIRS ghosts */
+    lru_engine_t engine;
+    replacement_policy_t policy;
+    int write;           /* WRITE_THROUGH / WRITE_NO_ALLOCATE */
+    uint64_t rng[4];     /* xoshiro256** state, for POLICY_RANDOM */
+    /* tree bits to clear and to set when a way is used, for POLICY_PLRU */
+    uint64_t plru_clear[PLRU_MAX_WAYS];
+    uint64_t plru_set[PLRU_MAX_WAYS];
+    unsigned char rrpv_max; /* distant re-reference, 2^rrpv_bits - 1 */
+    unsigned int psel;      /* DRRIP policy selector */
+    const uint64_t *opt_next; /* next-use position of every access */
+    size_t opt_pos;           /* position of the access being simulated */
+    sampled_set_t *sampled;   /* sets replayed by OPTgen, for Hawkeye */
+    int window;               /* history entries of a sampled set */
+    unsigned char *predictor; /* Hawkeye counters, indexed by signature */
+    sim_kernel_t kernel; /* chosen by init_kernel() from E, b and engine */
+    void *block;         /* the single allocation holding all the storage */
+    queue_set_t *sets;   /* S sets, unless the cache is direct-mapped */
+    unsigned long *line_tag; /* tag of every set, for ENGINE_DIRECT */
+    uint64_t *line_valid;    /* valid bit of every set, for ENGINE_DIRECT */
+    uint64_t *line_dirty;    /* dirty bit of every set, for ENGINE_DIRECT */
+    uint32_t *hash_slot; /* way index + 1 of every slot, 0 if empty */
+    size_t hash_mask;    /* number of slots - 1, for ENGINE_HASH */
+    unsigned long hit;
+    unsigned long miss;
+    unsigned long eviction;
+    unsigned long dirty_count;
+    unsigned long dirty_eviction;
+    unsigned long write_bytes;  /* bytes of stores sent to the next level */
+    prefetch_t prefetch;
+    struct prefetcher *prefetcher; /* NULL without prefetching */
+    unsigned long prefetches;       /* lines filled by the prefetcher */
+    unsigned long useful_prefetches; /* of which used by a demand access */
+    unsigned long pollution_misses; /* misses on lines a prefetch evicted */
+    int prefetching;            /* whether the fill being made is a prefetch */
+    int evicted;                /* whether the last access evicted a line */
+    int victim_dirty;           /* whether that line was dirty */
+    unsigned long victim_block; /* its block number, address >> b */
+} cache_t;
+
+/** @brief reserve n elements of the given size at the end of the block
+ *         being laid out, aligned to a cache line.
+ *
+ *  @param[in,out] size      Current size of the block.
+ *  @param[in]     n         Number of elements.
+ *  @param[in]     elem      Size of one element.
+ *  @return offset of the reserved elements in the block.
+ */
+static size_t reserve(size_t *size, size_t n, size_t elem) {
+    size_t offset = (*size + 63) & ~(size_t)63;
+    *size = offset + n * elem;
+    return offset;
+}
+
+static void init_kernel(cache_t *cache);
+static void kernel_prefetch(cache_t *cache, const trace_record_t *rec,
+                            size_t n);
+int init_prefetcher(cache_t *cache, prefetch_t kind, int degree);
+void free_prefetcher(cache_t *cache);
+
+/** @brief precompute, for every way, the tree bits that using it clears
+ *         and sets. Node i of the tree is bit i of the word, with the root
+ *         at 1 and the children of node i at 2i and 2i+1; way w is leaf
+ *         E+w. A set bit means the right subtree is the less recently used.
+ *
+ *  @return 0 on success, -1 if E is not a power of two up to
+ *          PLRU_MAX_WAYS.
+ */
+static int init_plru(cache_t *cache) {
+    int E = cache->E;
+    if (E > PLRU_MAX_WAYS || (E & (E - 1)) != 0)
+        return -1;
+    for (int way = 0; way < E; way++) {
+        uint64_t clear = 0, set = 0;
+        // every ancestor points away from the path to the way
+        for (int node = E + way; node > 1; node >>= 1) {
+            uint64_t bit = (uint64_t)1 << (node >> 1);
+            clear |= bit;
+            if ((node & 1) == 0)
+                set |= bit;
+        }
+        cache->plru_clear[way] = ~clear;
+        cache->plru_set[way] = set;
+    }
+    return 0;
+}
+
+/** @brief seed a xoshiro256** generator from one word with splitmix64, so
+ *         that nearby seeds still give unrelated streams.
+ */
+static void init_rng(uint64_t rng[4], uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        rng[i] = z ^ (z >> 31);
+    }
+}
+
+/** @brief next output of a xoshiro256** generator. */
+static inline uint64_t next_rng(uint64_t rng[4]) {
+    uint64_t result = rng[1] * 5;
+    result = ((result << 7) | (result >> 57)) * 9;
+    uint64_t t = rng[1] << 17;
+    rng[2] ^= rng[0];
+    rng[3] ^= rng[1];
+    rng[1] ^= rng[2];
+    rng[0] ^= rng[3];
+    rng[2] ^= t;
+    rng[3] = (rng[3] << 45) | (rng[3] >> 19);
+    return result;
+}
+
+/** @brief allocate the sets and all of their ways in a single block.
+ *
+ *  @param[out]    cache     Cache to initialize.
+ *  @param[in]     s         Number of set bits.
+ *  @param[in]     E         Number of lines per set.
+ *  @param[in]     b         Number of block offset bits.
+ *  @param[in]     options   Engine, replacement policy and seed.
+ *  @return 0 on success, -1 if the memory could not be allocated, the
+ *          engine does not support E ways or is chosen for a policy other
+ *          than LRU, or a prefetcher is asked of a direct-mapped engine or
+ *          of OPT.
+ */
+int init_cache(cache_t *cache, int s, int E, int b,
+               const cache_options_t *options) {
+    lru_engine_t engine = options->engine;
+    replacement_policy_t policy = options->policy;
+    memset(cache, 0, sizeof(*cache));
+    cache->s = s;
+    cache->E = E;
+    cache->b = b;
+    cache->S = 1 << s;
+    cache->B = 1 << b;
+    cache->t = ADDRESS_BITS - (s + b);
+
+    // every policy evicts the only way of a direct-mapped cache
+    if (E == 1)
+        policy = POLICY_LRU;
+    // without leader sets PSEL would never move from its midpoint
+    if (policy == POLICY_DRRIP && s == 0)
+        policy = POLICY_SRRIP;
+    if (policy != POLICY_LRU) {
+        if (engine != ENGINE_AUTO)
+            return -1;
+        engine = ENGINE_LIST;
+    }
+    cache->policy = policy;
+    cache->write = options->write;
+    cache->prefetch = options->prefetch;
+    init_rng(cache->rng, options->seed);
+    if (policy == POLICY_PLRU && init_plru(cache) != 0)
+        return -1;
+    int rrip = policy == POLICY_SRRIP || policy == POLICY_BRRIP ||
+               policy == POLICY_DRRIP;
+    if (rrip && (options->rrpv_bits < 1 || options->rrpv_bits > 7))
+        return -1;
+    cache->rrpv_max = (unsigned char)((1 << options->rrpv_bits) - 1);
+    cache->psel = 1u << (PSEL_BITS - 1);
+    int adaptive = policy == POLICY_ARC || policy == POLICY_LIRS;
+    cache->nodes = adaptive ? 2 * E : E;
+    // a prefetched line is marked in the flags, which ENGINE_DIRECT lacks
+    int prefetch = options->prefetch != PREFETCH_NONE;
+    if (prefetch && (engine == ENGINE_DIRECT || policy == POLICY_OPT))
+        return -1;
+    if (engine == ENGINE_AUTO) {
+        if (E == 1)
+            engine = prefetch ? ENGINE_LIST : ENGINE_DIRECT;
+        else if (E > HASH_MIN_WAYS)
+            engine = ENGINE_HASH;
+        else
+            engine = E <= AGE_MAX_WAYS ? ENGINE_AGE : ENGINE_LIST;
+    }
+    if ((engine == ENGINE_AGE && E > AGE_MAX_WAYS) ||
+        (engine == ENGINE_MATRIX && E > MATRIX_MAX_WAYS) ||
+        (engine == ENGINE_DIRECT && E != 1) ||
+        ((engine == ENGINE_HASH || adaptive) &&
+         (size_t)cache->S * (size_t)cache->nodes >= UINT32_MAX))
+        return -1;
+    cache->engine = engine;
+
+    size_t S = (size_t)cache->S;
+    if (engine == ENGINE_DIRECT) {
+        size_t words = (S + 63) / 64;
+        size_t size = 0;
+        size_t tags_at = reserve(&size, S, sizeof(unsigned long));
+        size_t valid_at = reserve(&size, words, sizeof(uint64_t));
+        size_t dirty_at = reserve(&size, words, sizeof(uint64_t));
+        char *block = aligned_alloc(64, (size + 63) & ~(size_t)63);
+        if (block == NULL)
+            return -1;
+        memset(block, 0, size);
+        cache->block = block;
+        cache->line_tag = (unsigned long *)(block + tags_at);
+        cache->line_valid = (uint64_t *)(block + valid_at);
+        cache->line_dirty = (uint64_t *)(block + dirty_at);
+        init_kernel(cache);
+        return 0;
+    }
+
+    size_t N = (size_t)cache->nodes;
+    size_t ways = S * N;
+    size_t size = 0;
+    size_t sets_at = reserve(&size, S, sizeof(queue_set_t));
+    size_t tags_at = reserve(&size, ways, sizeof(unsigned long));
+    size_t flags_at = reserve(&size, ways, sizeof(unsigned char));
+    int linked = (policy == POLICY_LRU &&
+                  (engine == ENGINE_LIST || engine == ENGINE_HASH)) ||
+                 adaptive;
+    size_t links = linked ? ways : 0;
+    size_t prevs_at = reserve(&size, links, sizeof(int));
+    size_t nexts_at = reserve(&size, links, sizeof(int));
+    size_t ages = engine == ENGINE_AGE ? S * AGE_MAX_WAYS : 0;
+    size_t ages_at = reserve(&size, ages, sizeof(unsigned char));
+    int hawkeye = policy == POLICY_HAWKEYE;
+    size_t metas =
+        policy == POLICY_FIFO || policy == POLICY_LFU ||
+                policy == POLICY_NRU || hawkeye || adaptive
+            ? ways
+            : 0;
+    size_t metas_at = reserve(&size, metas, sizeof(uint32_t));
+    size_t rrpvs = rrip || hawkeye ? ways : 0;
+    size_t rrpvs_at = reserve(&size, rrpvs, sizeof(unsigned char));
+    size_t uses = policy == POLICY_OPT ? ways : 0;
+    size_t uses_at = reserve(&size, uses, sizeof(uint64_t));
+    size_t qlinks = policy == POLICY_LIRS ? ways : 0;
+    size_t qprevs_at = reserve(&size, qlinks, sizeof(int));
+    size_t qnexts_at = reserve(&size, qlinks, sizeof(int));
+    size_t lists = adaptive ? S * ARC_LISTS : 0;
+    size_t lists_at = reserve(&size, lists, sizeof(node_list_t));
+    size_t samples = 0, window = 0, counters = 0;
+    if (hawkeye) {
+        samples = S < HAWKEYE_SAMPLED_SETS ? S : HAWKEYE_SAMPLED_SETS;
+        window = HAWKEYE_HISTORY * (size_t)E;
+        counters = (size_t)1 << HAWKEYE_PREDICTOR_BITS;
+    }
+    size_t history = samples * window;
+    size_t samples_at = reserve(&size, samples, sizeof(sampled_set_t));
+    size_t blocks_at = reserve(&size, history, sizeof(unsigned long));
+    size_t valids_at = reserve(&size, history, sizeof(unsigned char));
+    size_t times_at = reserve(&size, history, sizeof(uint64_t));
+    size_t sigs_at = reserve(&size, history, sizeof(uint32_t));
+    size_t occupancy_at = reserve(&size, history, sizeof(uint32_t));
+    size_t counters_at = reserve(&size, counters, sizeof(unsigned char));
+    // keep the hash table at most half full
+    size_t slots = 0;
+    if (engine == ENGINE_HASH || adaptive) {
+        slots = 16;
+        while (slots < 2 * ways)
+            slots *= 2;
+    }
+    size_t slots_at = reserve(&size, slots, sizeof(uint32_t));
+    char *block = aligned_alloc(64, (size + 63) & ~(size_t)63);
+    if (block == NULL)
+        return -1;
+
+    cache->block = block;
+    cache->sets = (queue_set_t *)(block + sets_at);
+    unsigned long *tags = (unsigned long *)(block + tags_at);
+    unsigned char *flags = (unsigned char *)(block + flags_at);
+    int *prevs = (int *)(block + prevs_at);
+    int *nexts = (int *)(block + nexts_at);
+    unsigned char *age = (unsigned char *)(block + ages_at);
+    uint32_t *meta = (uint32_t *)(block + metas_at);
+    unsigned char *rrpv = (unsigned char *)(block + rrpvs_at);
+    uint64_t *next_use = (uint64_t *)(block + uses_at);
+    cache->sampled = (sampled_set_t *)(block + samples_at);
+    cache->window = (int)window;
+    cache->predictor = (unsigned char *)(block + counters_at);
+    // signatures start weakly cache-friendly
+    memset(cache->predictor, (HAWKEYE_COUNTER_MAX + 1) / 2, counters);
+    memset(block + valids_at, 0, history);
+    for (size_t i = 0; i < samples; i++) {
+        sampled_set_t *sample = &cache->sampled[i];
+        sample->block = (unsigned long *)(block + blocks_at) + i * window;
+        sample->valid = (unsigned char *)(block + valids_at) + i * window;
+        sample->time = (uint64_t *)(block + times_at) + i * window;
+        sample->sig = (uint32_t *)(block + sigs_at) + i * window;
+        sample->occupancy =
+            (uint32_t *)(block + occupancy_at) + i * window;
+        sample->clock = 0;
+        sample->used = 0;
+    }
+    memset(tags, 0, ways * sizeof(unsigned long));
+    memset(flags, 0, ways);
+    memset(age, 0, ages);
+    memset(meta, 0, metas * sizeof(uint32_t));
+    memset(rrpv, 0, rrpvs);
+    memset(next_use, 0, uses * sizeof(uint64_t));
+    // DRRIP leaders are spread evenly, one of each kind per constituency
+    size_t leaders = S / 2 < DRRIP_LEADERS ? S / 2 : DRRIP_LEADERS;
+    size_t constituency = leaders ? S / leaders : 0;
+    cache->hash_slot = (uint32_t *)(block + slots_at);
+    cache->hash_mask = slots - 1;
+    memset(cache->hash_slot, 0, slots * sizeof(uint32_t));
+    for (size_t i = 0; i < S; i++) {
+        queue_set_t *set = &cache->sets[i];
+        set->tag = tags + i * N;
+        set->flags = flags + i * N;
+        set->prev = links ? prevs + i * N : NULL;
+        set->next = links ? nexts + i * N : NULL;
+        set->age = ages ? age + i * AGE_MAX_WAYS : NULL;
+        set->matrix = 0;
+        set->meta = metas ? meta + i * N : NULL;
+        set->qprev = qlinks ? (int *)(block + qprevs_at) + i * N : NULL;
+        set->qnext = qlinks ? (int *)(block + qnexts_at) + i * N : NULL;
+        set->lists = lists ? (node_list_t *)(block + lists_at) +
+                                 i * ARC_LISTS
+                           : NULL;
+        for (int j = 0; lists && j < ARC_LISTS; j++)
+            set->lists[j] = (node_list_t){-1, -1, 0};
+        set->target = 0;
+        set->free_node = -1;
+        set->holes = 0;
+        set->rrpv = rrpvs ? rrpv + i * (size_t)E : NULL;
+        set->next_use = uses ? next_use + i * (size_t)E : NULL;
+        set->state = 0;
+        if (policy == POLICY_DRRIP && leaders) {
+            if (i % constituency == 0)
+                set->state = LEADER_SRRIP;
+            else if (i % constituency == constituency - 1)
+                set->state = LEADER_BRRIP;
+        }
+        // sampled sets are spread evenly and hold their index + 1
+        if (hawkeye && i % (S / samples) == 0)
+            set->state = i / (S / samples) + 1;
+        set->head = -1;
+        set->tail = -1;
+        set->curr_line_num = 0;
+    }
+    if (prefetch &&
+        init_prefetcher(cache, options->prefetch, options->prefetch_degree))
+        return -1;
+    init_kernel(cache);
+    return 0;
+}
+
+/** A tag matcher returns the first valid way among the first n ways whose
+ *  tag equals the given one, or -1 if there is none.
+ */
+typedef int (*match_tag_fn)(const unsigned long *tags,
+                            const unsigned char *flags, int n,
+                            unsigned long tag);
+
+/** @brief compare the tag against every way one by one. */
+static int match_tag_scalar(const unsigned long *tags,
+                            const unsigned char *flags, int n,
+                            unsigned long tag) {
+    for (int i = 0; i < n; i++) {
+        if (tags[i] == tag && (flags[i] & LINE_VALID))
+            return i;
+    }
+    return -1;
+}
+
+#ifdef HAVE_X86_SIMD
+/** @brief return the first valid way among the candidates in mask, which
+ *         holds one bit per way starting at way base.
+ */
+static inline int first_valid(const unsigned char *flags, int base,
+                              unsigned int mask) {
+    while (mask != 0) {
+        int i = base + __builtin_ctz(mask);
+        if (flags[i] & LINE_VALID)
+            return i;
+        mask &= mask - 1;
+    }
+    return -1;
+}
+
+/** @brief compare the tag against 8 ways per iteration with two AVX2
+ *         compares, collecting the matches with movemask.
+ */
+__attribute__((target("avx2"))) static int
+match_tag_avx2(const unsigned long *tags, const unsigned char *flags, int n,
+               unsigned long tag) {
+    __m256i key = _mm256_set1_epi64x((long long)tag);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i lo = _mm256_loadu_si256((const __m256i *)(tags + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i *)(tags + i + 4));
+        unsigned int mask =
+            (unsigned int)_mm256_movemask_pd(
+                _mm256_castsi256_pd(_mm256_cmpeq_epi64(lo, key))) |
+            ((unsigned int)_mm256_movemask_pd(
+                 _mm256_castsi256_pd(_mm256_cmpeq_epi64(hi, key)))
+             << 4);
+        if (mask != 0) {
+            int way = first_valid(flags, i, mask);
+            if (way >= 0)
+                return way;
+        }
+    }
+    if (i + 4 <= n) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(tags + i));
+        unsigned int mask = (unsigned int)_mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpeq_epi64(v, key)));
+        if (mask != 0) {
+            int way = first_valid(flags, i, mask);
+            if (way >= 0)
+                return way;
+        }
+        i += 4;
+    }
+    for (; i < n; i++) {
+        if (tags[i] == tag && (flags[i] & LINE_VALID))
+            return i;
+    }
+    return -1;
+}
+
+/** @brief compare the tag against 16 ways per iteration with two AVX-512
+ *         compares; the remainder is handled with a masked load.
+ */
+__attribute__((target("avx512f"))) static int
+match_tag_avx512(const unsigned long *tags, const unsigned char *flags, int n,
+                 unsigned long tag) {
+    __m512i key = _mm512_set1_epi64((long long)tag);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i lo = _mm512_loadu_si512((const void *)(tags + i));
+        __m512i hi = _mm512_loadu_si512((const void *)(tags + i + 8));
+        unsigned int mask =
+            (unsigned int)_mm512_cmpeq_epu64_mask(lo, key) |
+            ((unsigned int)_mm512_cmpeq_epu64_mask(hi, key) << 8);
+        if (mask != 0) {
+            int way = first_valid(flags, i, mask);
+            if (way >= 0)
+                return way;
+        }
+    }
+    while (i < n) {
+        int left = n - i < 8 ? n - i : 8;
+        __mmask8 load = (__mmask8)((1u << left) - 1);
+        __m512i v = _mm512_maskz_loadu_epi64(load, tags + i);
+        unsigned int mask =
+            (unsigned int)_mm512_mask_cmpeq_epu64_mask(load, v, key);
+        if (mask != 0) {
+            int way = first_valid(flags, i, mask);
+            if (way >= 0)
+                return way;
+        }
+        i += left;
+    }
+    return -1;
+}
+#endif
+
+/** A furthest-use finder returns the lowest of the first n ways with the
+ *  largest next-use position, every position being at most INT64_MAX.
+ */
+typedef int (*furthest_fn)(const uint64_t *next_use, int n);
+
+static int furthest_scalar(const uint64_t *next_use, int n) {
+    int way = 0;
+    for (int i = 1; i < n; i++) {
+        if (next_use[i] > next_use[way])
+            way = i;
+    }
+    return way;
+}
+
+#ifdef HAVE_X86_SIMD
+/** @brief keep the largest position of every lane across the ways with a
+ *         signed 64-bit compare, then find the first way holding it.
+ */
+__attribute__((target("avx2"))) static int
+furthest_avx2(const uint64_t *next_use, int n) {
+    int i = 0;
+    uint64_t top = 0;
+    if (n >= 4) {
+        __m256i best = _mm256_loadu_si256((const __m256i *)next_use);
+        for (i = 4; i + 4 <= n; i += 4) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(next_use + i));
+            best = _mm256_blendv_epi8(best, v, _mm256_cmpgt_epi64(v, best));
+        }
+        uint64_t lane[4];
+        _mm256_storeu_si256((__m256i *)lane, best);
+        for (int j = 0; j < 4; j++)
+            top = lane[j] > top ? lane[j] : top;
+    }
+    for (; i < n; i++)
+        top = next_use[i] > top ? next_use[i] : top;
+
+    __m256i key = _mm256_set1_epi64x((long long)top);
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(next_use + i));
+        unsigned int mask = (unsigned int)_mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpeq_epi64(v, key)));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    for (; i < n; i++) {
+        if (next_use[i] == top)
+            return i;
+    }
+    return 0;
+}
+#endif
+
+/* Tag matcher and furthest-use finder picked by init_match_tag() for the
+ * running CPU */
+static match_tag_fn match_tag = match_tag_scalar;
+static furthest_fn furthest = furthest_scalar;
+
+/** @brief pick the widest tag matcher and furthest-use finder the CPU
+ *         supports.
+ */
+void init_match_tag(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        match_tag = match_tag_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+        match_tag = match_tag_avx2;
+    if (__builtin_cpu_supports("avx2"))
+        furthest = furthest_avx2;
+#endif
+}
+
+/** @brief account for the eviction of a way that is about to be reused,
+ *         and remember its block for the level below. A way invalidated by
+ *         the level below holds nothing to evict.
+ */
+static inline void evict_way(cache_t *cache, queue_set_t *set, int way) {
+    if (!(set->flags[way] & LINE_VALID))
+        return;
+    int dirty = (set->flags[way] & LINE_DIRTY) != 0;
+    cache->eviction += 1;
+    cache->dirty_eviction += (unsigned long)dirty;
+    cache->evicted = 1;
+    cache->victim_dirty = dirty;
+    cache->victim_block =
+        (set->tag[way] << cache->s) | (unsigned long)(set - cache->sets);
+}
+
+/** @brief move a way of an index-linked queue to the most recently used. */
+static inline void list_move_to_head(queue_set_t *set, int way) {
+    int prev_way = set->prev[way];
+    if (prev_way < 0)
+        return;
+    int next_way = set->next[way];
+    if (next_way >= 0)
+        set->prev[next_way] = prev_way;
+    else
+        set->tail = prev_way;
+    set->next[prev_way] = next_way;
+    set->prev[way] = -1;
+    set->next[way] = set->head;
+    set->prev[set->head] = way;
+    set->head = way;
+}
+
+/** @brief unlink the least recently used way of a non-empty queue. */
+static inline int list_pop_tail(queue_set_t *set) {
+    int way = set->tail;
+    set->tail = set->prev[way];
+    if (set->tail >= 0)
+        set->next[set->tail] = -1;
+    else
+        set->head = -1;
+    return way;
+}
+
+/** @brief move a way of an index-linked queue to the least recently used. */
+static inline void list_move_to_tail(queue_set_t *set, int way) {
+    int next_way = set->next[way];
+    if (next_way < 0)
+        return;
+    int prev_way = set->prev[way];
+    if (prev_way >= 0)
+        set->next[prev_way] = next_way;
+    else
+        set->head = next_way;
+    set->prev[next_way] = prev_way;
+    set->prev[way] = set->tail;
+    set->next[way] = -1;
+    set->next[set->tail] = way;
+    set->tail = way;
+}
+
+/** @brief link a way into the queue as the most recently used. */
+static inline void list_push_head(queue_set_t *set, int way) {
+    set->prev[way] = -1;
+    set->next[way] = set->head;
+    if (set->head >= 0)
+        set->prev[set->head] = way;
+    else
+        set->tail = way;
+    set->head = way;
+}
+
+/** @brief update the number of hit, miss, eviction and dirty eviction of
+ *         the cache, with the given tag and set index, keeping the LRU
+ *         order in the index-linked queue of the set.
+ *
+ *  @param[in]     cache          Pointer to the initialized cache.
+ *  @param[in]     curr_tag       Tag bits computed using the address.
+ *  @param[in]     curr_set_num   Set index computed using the address.
+ *  @param[in]     dirty          Set to 0 if it's a load operation,
+ *                                to 1 if it's a store operation.
+ */
+static void count_list(cache_t *cache, unsigned long curr_tag,
+                       unsigned long curr_set_num, int dirty) {
+    queue_set_t *set = &cache->sets[curr_set_num];
+
+    // check hit by searching for the way with the same tag
+    int way = match_tag(set->tag, set->flags, set->curr_line_num, curr_tag);
+
+    if (way >= 0) {
+        cache->hit += 1;
+        // if the operation is store, mark the dirty bit of the line
+        if (dirty == 1)
+            set->flags[way] |= LINE_DIRTY;
+        // move the way to the most recently used
+        list_move_to_head(set, way);
+        return;
+    }
+
+    // if not hit, then there is a miss
+    cache->miss += 1;
+    if (set->curr_line_num >= cache->E) {
+        // reuse the least recently used way
+        way = list_pop_tail(set);
+        evict_way(cache, set, way);
+    } else {
+        // the ways of a set are filled in order
+        way = set->curr_line_num;
+        set->curr_line_num += 1;
+    }
+
+    // insert the new line as the most recently used
+    set->tag[way] = curr_tag;
+    set->flags[way] = LINE_VALID | (dirty ? LINE_DIRTY : 0);
+    list_push_head(set, way);
+}
+
+/** @brief mix the bits of a key so that they can index a hash table. */
+static inline uint64_t hash64(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+/** @brief home slot of a (set, tag) pair in the hash table. */
+static inline size_t hash_home(const cache_t *cache, unsigned long curr_tag,
+                               unsigned long curr_set_num) {
+    return (size_t)hash64(curr_tag * 0x9e3779b97f4a7c15ULL + curr_set_num) &
+           cache->hash_mask;
+}
+
+/** @brief return the slot holding the line of (set, tag), or the empty
+ *         slot ending its probe sequence.
+ */
+static inline size_t hash_find(const cache_t *cache, unsigned long curr_tag,
+                               unsigned long curr_set_num) {
+    size_t first = curr_set_num * (size_t)cache->nodes;
+    size_t i = hash_home(cache, curr_tag, curr_set_num);
+    while (cache->hash_slot[i] != 0) {
+        size_t line = cache->hash_slot[i] - 1;
+        // the line belongs to the set iff it lies in the set's ways
+        if (line - first < (size_t)cache->nodes &&
+            cache->sets[curr_set_num].tag[line - first] == curr_tag)
+            return i;
+        i = (i + 1) & cache->hash_mask;
+    }
+    return i;
+}
+
+/** @brief remove the entry in slot i, shifting back later entries of the
+ *         probe run so that no tombstones are needed.
+ */
+static void hash_remove(cache_t *cache, size_t i) {
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & cache->hash_mask;
+        uint32_t slot = cache->hash_slot[j];
+        if (slot == 0)
+            break;
+        size_t line = slot - 1;
+        unsigned long set_num = line / (size_t)cache->nodes;
+        unsigned long tag = cache->sets[set_num].tag[line % cache->nodes];
+        size_t home = hash_home(cache, tag, set_num);
+        // move the entry back unless its home lies cyclically in (i, j]
+        if (((j - home) & cache->hash_mask) >= ((j - i) & cache->hash_mask)) {
+            cache->hash_slot[i] = slot;
+            i = j;
+        }
+    }
+    cache->hash_slot[i] = 0;
+}
+
+/** @brief same as count_list(), finding the way through the hash table. */
+static void count_hash(cache_t *cache, unsigned long curr_tag,
+                       unsigned long curr_set_num, int dirty) {
+    queue_set_t *set = &cache->sets[curr_set_num];
+    size_t first = curr_set_num * (size_t)cache->E;
+    size_t slot = hash_find(cache, curr_tag, curr_set_num);
+    if (cache->hash_slot[slot] != 0) {
+        int way = (int)(cache->hash_slot[slot] - 1 - first);
+        cache->hit += 1;
+        if (dirty == 1)
+            set->flags[way] |= LINE_DIRTY;
+        list_move_to_head(set, way);
+        return;
+    }
+
+    cache->miss += 1;
+    int way;
+    if (set->curr_line_num >= cache->E) {
+        way = list_pop_tail(set);
+        // a way invalidated by the level below already left the table
+        if (set->flags[way] & LINE_VALID) {
+            evict_way(cache, set, way);
+            hash_remove(cache, hash_find(cache, set->tag[way], curr_set_num));
+            // removing may have shifted the empty slot found above
+            slot = hash_find(cache, curr_tag, curr_set_num);
+        }
+    } else {
+        way = set->curr_line_num;
+        set->curr_line_num += 1;
+    }
+    set->tag[way] = curr_tag;
+    set->flags[way] = LINE_VALID | (dirty ? LINE_DIRTY : 0);
+    list_push_head(set, way);
+    cache->hash_slot[slot] = (uint32_t)(first + (size_t)way + 1);
+}
+
+/** @brief make way the MRU of an age-ranked set. Every way younger than
+ *         rank gets one year older, so the ranks stay a permutation.
+ *
+ *  @param[in]     set       Set to update.
+ *  @param[in]     way       Way that was just used.
+ *  @param[in]     rank      Age of the way before the access; the number
+ *                           of valid ways for a way that is being filled.
+ */
+static inline void age_touch(queue_set_t *set, int way, int rank) {
+#ifdef HAVE_X86_SIMD
+    __m128i ages = _mm_load_si128((const __m128i *)set->age);
+    __m128i younger = _mm_cmplt_epi8(ages, _mm_set1_epi8((char)rank));
+    // the comparison is -1 in younger lanes, so subtracting it adds one
+    _mm_store_si128((__m128i *)set->age, _mm_sub_epi8(ages, younger));
+#else
+    for (int i = 0; i < AGE_MAX_WAYS; i++) {
+        if (set->age[i] < rank)
+            set->age[i] += 1;
+    }
+#endif
+    set->age[way] = 0;
+}
+
+/** @brief return the way of a full age-ranked set whose age is E-1. */
+static inline int age_victim(const queue_set_t *set, int E) {
+#ifdef HAVE_X86_SIMD
+    __m128i ages = _mm_load_si128((const __m128i *)set->age);
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(ages, _mm_set1_epi8((char)(E - 1))));
+    return __builtin_ctz(mask & ((1u << E) - 1));
+#else
+    for (int i = 0; i < E; i++) {
+        if (set->age[i] == E - 1)
+            return i;
+    }
+    return 0;
+#endif
+}
+
+/** @brief access a set with the LRU order kept as age bytes. The
+ *         associativity is a parameter so that kernels specialised for a
+ *         constant E get every loop unrolled.
+ */
+static ALWAYS_INLINE void age_access(cache_t *cache, queue_set_t *set,
+                                     unsigned long curr_tag, int dirty,
+                                     int E) {
+    int way;
+    if (E <= AGE_MAX_WAYS / 2) {
+        // few enough ways to compare them all without branching
+        unsigned int mask = 0;
+        for (int i = 0; i < E; i++)
+            mask |= (unsigned int)(set->tag[i] == curr_tag &&
+                                   (set->flags[i] & LINE_VALID))
+                    << i;
+        way = mask ? __builtin_ctz(mask) : -1;
+    } else {
+        way = match_tag(set->tag, set->flags, set->curr_line_num, curr_tag);
+    }
+    if (way >= 0) {
+        cache->hit += 1;
+        if (dirty == 1)
+            set->flags[way] |= LINE_DIRTY;
+        age_touch(set, way, set->age[way]);
+        return;
+    }
+
+    cache->miss += 1;
+    int rank;
+    if (set->curr_line_num >= E) {
+        way = age_victim(set, E);
+        evict_way(cache, set, way);
+        rank = E - 1;
+    } else {
+        way = set->curr_line_num;
+        rank = set->curr_line_num;
+        set->curr_line_num += 1;
+    }
+    set->tag[way] = curr_tag;
+    set->flags[way] = LINE_VALID | (dirty ? LINE_DIRTY : 0);
+    age_touch(set, way, rank);
+}
+
+/** @brief same as count_list(), with the LRU order kept as age bytes. */
+static void count_age(cache_t *cache, unsigned long curr_tag,
+                      unsigned long curr_set_num, int dirty) {
+    age_access(cache, &cache->sets[curr_set_num], curr_tag, dirty, cache->E);
+}
+
+/* Low bit of every byte, i.e. column 0 of every row of the LRU matrix */
+#define MATRIX_COLUMN 0x0101010101010101UL
+
+/** @brief make way the MRU of a matrix-ordered set: its row is set to all
+ *         ones and its column is cleared.
+ */
+static inline void matrix_touch(queue_set_t *set, int way, int E) {
+    unsigned long row = ((1UL << E) - 1) << (8 * way);
+    set->matrix = (set->matrix | row) & ~(MATRIX_COLUMN << way);
+}
+
+/** @brief return the way of a full matrix-ordered set whose row is empty. */
+static inline int matrix_victim(const queue_set_t *set, int E) {
+    unsigned long m = set->matrix;
+    // the high bit of a byte is set iff the byte is not zero
+    unsigned long nonzero =
+        (((m & 0x7f7f7f7f7f7f7f7fUL) + 0x7f7f7f7f7f7f7f7fUL) | m) &
+        0x8080808080808080UL;
+    unsigned long empty = ~nonzero & 0x8080808080808080UL;
+    if (E < 8)
+        empty &= (1UL << (8 * E)) - 1;
+    return __builtin_ctzl(empty) / 8;
+}
+
+/** @brief same as count_list(), with the LRU order kept as a bit matrix. */
+static void count_matrix(cache_t *cache, unsigned long curr_tag,
+                         unsigned long curr_set_num, int dirty) {
+    queue_set_t *set = &cache->sets[curr_set_num];
+    int way = match_tag(set->tag, set->flags, set->curr_line_num, curr_tag);
+    if (way >= 0) {
+        cache->hit += 1;
+        if (dirty == 1)
+            set->flags[way] |= LINE_DIRTY;
+        matrix_touch(set, way, cache->E);
+        return;
+    }
+
+    cache->miss += 1;
+    if (set->curr_line_num >= cache->E) {
+        way = matrix_victim(set, cache->E);
+        evict_way(cache, set, way);
+    } else {
+        way = set->curr_line_num;
+        set->curr_line_num += 1;
+    }
+    set->tag[way] = curr_tag;
+    set->flags[way] = LINE_VALID | (dirty ? LINE_DIRTY : 0);
+    matrix_touch(set, way, cache->E);
+}
+
+/** @brief access a direct-mapped cache: one tag load, one compare and one
+ *         tag store, with the valid and dirty bits kept in bitsets.
+ */
+static ALWAYS_INLINE void direct_access(cache_t *cache,
+                                        unsigned long curr_tag,
+                                        unsigned long curr_set_num,
+                                        int dirty) {
+    unsigned long word = curr_set_num / 64;
+    uint64_t bit = (uint64_t)1 << (curr_set_num % 64);
+    if (cache->line_tag[curr_set_num] == curr_tag &&
+        (cache->line_valid[word] & bit)) {
+        cache->hit += 1;
+        if (dirty)
+            cache->line_dirty[word] |= bit;
+        return;
+    }
+
+    cache->miss += 1;
+    if (cache->line_valid[word] & bit) {
+        int was_dirty = (cache->line_dirty[word] & bit) != 0;
+        cache->eviction += 1;
+        cache->dirty_eviction += (unsigned long)was_dirty;
+        cache->evicted = 1;
+        cache->victim_dirty = was_dirty;
+        cache->victim_block =
+            (cache->line_tag[curr_set_num] << cache->s) | curr_set_num;
+    }
+    cache->line_tag[curr_set_num] = curr_tag;
+    cache->line_valid[word] |= bit;
+    if (dirty)
+        cache->line_dirty[word] |= bit;
+    else
+        cache->line_dirty[word] &= ~bit;
+}
+
+/* Policy hooks: a policy named p defines p_hit() and p_fill(), called
+ * after a hit on and a fill of a way, and p_victim(), which returns the way
+ * of a full set to evict. They are inlined into count_p() and kernel_p(),
+ * so switching policy costs no indirect call per access. */
+
+static ALWAYS_INLINE void fifo_hit(cache_t *cache, queue_set_t *set,
+                                   int way) {
+    (void)cache, (void)set, (void)way;
+}
+
+static ALWAYS_INLINE void fifo_fill(cache_t *cache, queue_set_t *set,
+                                    int way) {
+    (void)cache;
+    set->meta[way] = (uint32_t)set->state++;
+}
+
+/* ages are taken modulo 2^32, so the stamps may wrap around */
+static ALWAYS_INLINE int fifo_victim(cache_t *cache, queue_set_t *set) {
+    uint32_t now = (uint32_t)set->state;
+    int victim = 0;
+    for (int i = 1; i < cache->E; i++) {
+        if (now - set->meta[i] > now - set->meta[victim])
+            victim = i;
+    }
+    return victim;
+}
+
+static ALWAYS_INLINE void random_hit(cache_t *cache, queue_set_t *set,
+                                     int way) {
+    (void)cache, (void)set, (void)way;
+}
+
+static ALWAYS_INLINE void random_fill(cache_t *cache, queue_set_t *set,
+                                      int way) {
+    (void)cache, (void)set, (void)way;
+}
+
+/* the high 32 bits scaled to [0, E) without a division */
+static ALWAYS_INLINE int random_victim(cache_t *cache, queue_set_t *set) {
+    (void)set;
+    uint64_t r = next_rng(cache->rng) >> 32;
+    return (int)((r * (uint64_t)cache->E) >> 32);
+}
+
+static ALWAYS_INLINE void lfu_hit(cache_t *cache, queue_set_t *set,
+                                  int way) {
+    (void)cache;
+    if (set->meta[way] != UINT32_MAX)
+        set->meta[way] += 1;
+}
+
+static ALWAYS_INLINE void lfu_fill(cache_t *cache, queue_set_t *set,
+                                   int way) {
+    (void)cache;
+    set->meta[way] = 1;
+}
+
+static ALWAYS_INLINE int lfu_victim(cache_t *cache, queue_set_t *set) {
+    int victim = 0;
+    for (int i = 1; i < cache->E; i++) {
+        if (set->meta[i] < set->meta[victim])
+            victim = i;
+    }
+    return victim;
+}
+
+static ALWAYS_INLINE void nru_hit(cache_t *cache, queue_set_t *set,
+                                  int way) {
+    (void)cache;
+    set->meta[way] = 1;
+}
+
+static ALWAYS_INLINE void nru_fill(cache_t *cache, queue_set_t *set,
+                                   int way) {
+    (void)cache;
+    set->meta[way] = 1;
+}
+
+static ALWAYS_INLINE int nru_victim(cache_t *cache, queue_set_t *set) {
+    for (int i = 0; i < cache->E; i++) {
+        if (set->meta[i] == 0)
+            return i;
+    }
+    memset(set->meta, 0, (size_t)cache->E * sizeof(uint32_t));
+    return 0;
+}
+
+static ALWAYS_INLINE void plru_hit(cache_t *cache, queue_set_t *set,
+                                   int way) {
+    set->state = (set->state & cache->plru_clear[way]) | cache->plru_set[way];
+}
+
+static ALWAYS_INLINE void plru_fill(cache_t *cache, queue_set_t *set,
+                                    int way) {
+    plru_hit(cache, set, way);
+}
+
+/* follow the tree from the root, one level per bit of the way index */
+static ALWAYS_INLINE int plru_victim(cache_t *cache, queue_set_t *set) {
+    unsigned long node = 1;
+    while (node < (unsigned long)cache->E)
+        node = 2 * node + ((set->state >> node) & 1);
+    return (int)(node - (unsigned long)cache->E);
+}
+
+/** @brief return the lowest way of a full set whose RRPV is max, first
+ *         raising every RRPV of the set by the distance between max and
+ *         the largest of them, which is what incrementing them all until
+ *         one reaches max amounts to.
+ */
+static inline int rrip_victim(cache_t *cache, queue_set_t *set) {
+    unsigned char *rrpv = set->rrpv;
+    int E = cache->E;
+    int max = cache->rrpv_max;
+    int i = 0;
+    int top = 0;
+#ifdef HAVE_X86_SIMD
+    __m128i maxv = _mm_set1_epi8((char)max);
+    __m128i topv = _mm_setzero_si128();
+    for (; i + 16 <= E; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(rrpv + i));
+        unsigned int hit = (unsigned int)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, maxv));
+        if (hit)
+            return i + __builtin_ctz(hit);
+        topv = _mm_max_epu8(topv, v);
+    }
+    // fold the largest byte into lane 0
+    topv = _mm_max_epu8(topv, _mm_srli_si128(topv, 8));
+    topv = _mm_max_epu8(topv, _mm_srli_si128(topv, 4));
+    topv = _mm_max_epu8(topv, _mm_srli_si128(topv, 2));
+    topv = _mm_max_epu8(topv, _mm_srli_si128(topv, 1));
+    top = _mm_cvtsi128_si32(topv) & 0xff;
+#endif
+    for (; i < E; i++) {
+        if (rrpv[i] == max)
+            return i;
+        if (rrpv[i] > top)
+            top = rrpv[i];
+    }
+
+    // no way is at max yet: age the whole set at once
+    int delta = max - top;
+    int victim = -1;
+    i = 0;
+#ifdef HAVE_X86_SIMD
+    __m128i deltav = _mm_set1_epi8((char)delta);
+    for (; i + 16 <= E; i += 16) {
+        __m128i v = _mm_add_epi8(
+            _mm_loadu_si128((const __m128i *)(rrpv + i)), deltav);
+        _mm_storeu_si128((__m128i *)(rrpv + i), v);
+        unsigned int hit = (unsigned int)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, maxv));
+        if (victim < 0 && hit)
+            victim = i + __builtin_ctz(hit);
+    }
+#endif
+    for (; i < E; i++) {
+        rrpv[i] = (unsigned char)(rrpv[i] + delta);
+        if (victim < 0 && rrpv[i] == max)
+            victim = i;
+    }
+    return victim;
+}
+
+static ALWAYS_INLINE void srrip_hit(cache_t *cache, queue_set_t *set,
+                                    int way) {
+    (void)cache;
+    set->rrpv[way] = 0;
+}
+
+static ALWAYS_INLINE void srrip_fill(cache_t *cache, queue_set_t *set,
+                                     int way) {
+    set->rrpv[way] = (unsigned char)(cache->rrpv_max - 1);
+}
+
+static ALWAYS_INLINE int srrip_victim(cache_t *cache, queue_set_t *set) {
+    return rrip_victim(cache, set);
+}
+
+static ALWAYS_INLINE void brrip_hit(cache_t *cache, queue_set_t *set,
+                                    int way) {
+    srrip_hit(cache, set, way);
+}
+
+static ALWAYS_INLINE void brrip_fill(cache_t *cache, queue_set_t *set,
+                                     int way) {
+    int distant = next_rng(cache->rng) % BRRIP_LONG_ODDS != 0;
+    set->rrpv[way] = (unsigned char)(cache->rrpv_max - !distant);
+}
+
+static ALWAYS_INLINE int brrip_victim(cache_t *cache, queue_set_t *set) {
+    return rrip_victim(cache, set);
+}
+
+static ALWAYS_INLINE void drrip_hit(cache_t *cache, queue_set_t *set,
+                                    int way) {
+    srrip_hit(cache, set, way);
+}
+
+/* a fill is a miss of the set: leaders move PSEL away from their policy */
+static ALWAYS_INLINE void drrip_fill(cache_t *cache, queue_set_t *set,
+                                     int way) {
+    unsigned int psel_max = (1u << PSEL_BITS) - 1;
+    int brrip;
+    if (set->state == LEADER_SRRIP) {
+        if (cache->psel < psel_max)
+            cache->psel += 1;
+        brrip = 0;
+    } else if (set->state == LEADER_BRRIP) {
+        if (cache->psel > 0)
+            cache->psel -= 1;
+        brrip = 1;
+    } else {
+        brrip = cache->psel >= 1u << (PSEL_BITS - 1);
+    }
+    if (brrip)
+        brrip_fill(cache, set, way);
+    else
+        srrip_fill(cache, set, way);
+}
+
+static ALWAYS_INLINE int drrip_victim(cache_t *cache, queue_set_t *set) {
+    return rrip_victim(cache, set);
+}
+
+/* every access is either a hit or a fill, so each takes the next position */
+static ALWAYS_INLINE void opt_hit(cache_t *cache, queue_set_t *set,
+                                  int way) {
+    set->next_use[way] = cache->opt_next[cache->opt_pos++];
+}
+
+static ALWAYS_INLINE void opt_fill(cache_t *cache, queue_set_t *set,
+                                   int way) {
+    opt_hit(cache, set, way);
+}
+
+static ALWAYS_INLINE int opt_victim(cache_t *cache, queue_set_t *set) {
+    return furthest(set->next_use, cache->E);
+}
+
+/** @brief return the predictor entry of the line in a way: a hash of the
+ *         region of addresses holding it.
+ */
+static inline uint32_t hawkeye_signature(cache_t *cache, queue_set_t *set,
+                                         int way) {
+    uint64_t block = ((uint64_t)set->tag[way] << cache->s) |
+                     (uint64_t)(set - cache->sets);
+    uint64_t region = cache->b < HAWKEYE_REGION_BITS
+                          ? block >> (HAWKEYE_REGION_BITS - cache->b)
+                          : block;
+    return (uint32_t)hash64(region) &
+           (((uint32_t)1 << HAWKEYE_PREDICTOR_BITS) - 1);
+}
+
+static inline void hawkeye_train(cache_t *cache, uint32_t sig, int friendly) {
+    unsigned char *counter = &cache->predictor[sig];
+    if (friendly && *counter < HAWKEYE_COUNTER_MAX)
+        *counter += 1;
+    else if (!friendly && *counter > 0)
+        *counter -= 1;
+}
+
+/** @brief replay an access to a sampled set with OPTgen and train the
+ *         predictor on whether OPT would have hit the previous access to
+ *         the block.
+ */
+static void hawkeye_sample(cache_t *cache, sampled_set_t *sample,
+                           unsigned long block, uint32_t sig) {
+    uint64_t window = (uint64_t)cache->window;
+    uint64_t now = sample->clock++;
+    sample->occupancy[now % window] = 0;
+    int entry = match_tag(sample->block, sample->valid, sample->used, block);
+    if (entry >= 0) {
+        uint64_t then = sample->time[entry];
+        int fits = now - then < window;
+        for (uint64_t t = then; fits && t < now; t++)
+            fits = sample->occupancy[t % window] < (uint32_t)cache->E;
+        // OPT keeps the line from its previous access to this one
+        for (uint64_t t = then; fits && t < now; t++)
+            sample->occupancy[t % window] += 1;
+        hawkeye_train(cache, sample->sig[entry], fits);
+    } else if (sample->used < cache->window) {
+        entry = sample->used++;
+    } else {
+        // the least recent entry is out of the window, never reused
+        entry = 0;
+        for (int i = 1; i < cache->window; i++) {
+            if (sample->time[i] < sample->time[entry])
+                entry = i;
+        }
+        hawkeye_train(cache, sample->sig[entry], 0);
+    }
+    sample->block[entry] = block;
+    sample->valid[entry] = LINE_VALID;
+    sample->time[entry] = now;
+    sample->sig[entry] = sig;
+}
+
+/** @brief train on the access if the set is sampled, and set the RRPV of
+ *         the way from the prediction for its line. A prefetch is not an
+ *         access of the program, so OPTgen never sees it.
+ *
+ *  @return whether the line is predicted cache-friendly.
+ */
+static inline int hawkeye_access(cache_t *cache, queue_set_t *set,
+                                 int way) {
+    uint32_t sig = hawkeye_signature(cache, set, way);
+    if (set->state != 0 && !cache->prefetching) {
+        unsigned long block =
+            (set->tag[way] << cache->s) | (unsigned long)(set - cache->sets);
+        hawkeye_sample(cache, &cache->sampled[set->state - 1], block, sig);
+    }
+    int friendly = cache->predictor[sig] > HAWKEYE_COUNTER_MAX / 2;
+    set->meta[way] = sig;
+    set->rrpv[way] = friendly ? 0 : HAWKEYE_RRPV_MAX;
+    return friendly;
+}
+
+static ALWAYS_INLINE void hawkeye_hit(cache_t *cache, queue_set_t *set,
+                                      int way) {
+    hawkeye_access(cache, set, way);
+}
+
+/* a friendly fill ages the other friendly lines, short of the averse */
+static ALWAYS_INLINE void hawkeye_fill(cache_t *cache, queue_set_t *set,
+                                       int way) {
+    if (!hawkeye_access(cache, set, way))
+        return;
+    for (int i = 0; i < set->curr_line_num; i++) {
+        if (i != way && set->rrpv[i] < HAWKEYE_RRPV_MAX - 1)
+            set->rrpv[i] += 1;
+    }
+}
+
+/* evict a cache-averse line, or else the oldest friendly one, whose
+ * signature was wrong to predict it friendly unless no demand access
+ * ever reached the line */
+static ALWAYS_INLINE int hawkeye_victim(cache_t *cache, queue_set_t *set) {
+    int victim = 0;
+    for (int i = 0; i < cache->E; i++) {
+        if (set->rrpv[i] == HAWKEYE_RRPV_MAX)
+            return i;
+        if (set->rrpv[i] > set->rrpv[victim])
+            victim = i;
+    }
+    if (!(set->flags[victim] & LINE_PREFETCHED))
+        hawkeye_train(cache, set->meta[victim], 0);
+    return victim;
+}
+
+/** @brief access a set under a replacement policy given by its hooks,
+ *         which are compile-time constants wherever this is inlined.
+ */
+static ALWAYS_INLINE void
+policy_access(cache_t *cache, unsigned long curr_tag,
+              unsigned long curr_set_num, int dirty,
+              void (*on_hit)(cache_t *, queue_set_t *, int),
+              void (*on_fill)(cache_t *, queue_set_t *, int),
+              int (*victim)(cache_t *, queue_set_t *)) {
+    queue_set_t *set = &cache->sets[curr_set_num];
+    int way = match_tag(set->tag, set->flags, set->curr_line_num, curr_tag);
+    if (way >= 0) {
+        cache->hit += 1;
+        if (dirty == 1)
+            set->flags[way] |= LINE_DIRTY;
+        on_hit(cache, set, way);
+        return;
+    }
+
+    cache->miss += 1;
+    if (set->curr_line_num >= cache->E && set->holes > 0) {
+        way = 0;
+        while (set->flags[way] & LINE_VALID)
+            way++;
+        set->holes -= 1;
+    } else if (set->curr_line_num >= cache->E) {
+        way = victim(cache, set);
+        evict_way(cache, set, way);
+    } else {
+        way = set->curr_line_num;
+        set->curr_line_num += 1;
+    }
+    set->tag[way] = curr_tag;
+    set->flags[way] = LINE_VALID | (dirty ? LINE_DIRTY : 0);
+    on_fill(cache, set, way);
+}
+
+/** Policies besides LRU, each getting a count_<name>() for single accesses
+ *  and a kernel_<name>() for batches */
+#define REPLACEMENT_POLICIES(X)                                            \
+    X(fifo)                                                                \
+    X(random)                                                              \
+    X(lfu)                                                                 \
+    X(nru)                                                                 \
+    X(plru)                                                                \
+    X(srrip)                                                               \
+    X(brrip)                                                               \
+    X(drrip)                                                               \
+    X(opt)                                                                 \
+    X(hawkeye)
+
+#define DEFINE_POLICY(name)                                                \
+    static void count_##name(cache_t *cache, unsigned long curr_tag,       \
+                             unsigned long curr_set_num, int dirty) {      \
+        policy_access(cache, curr_tag, curr_set_num, dirty, name##_hit,    \
+                      name##_fill, name##_victim);                         \
+    }                                                                      \
+    static void kernel_##name(cache_t *cache, const trace_record_t *rec,   \
+                              size_t n) {                                  \
+        int s = cache->s, b = cache->b;                                    \
+        unsigned long set_mask = (unsigned long)(cache->S - 1);            \
+        for (size_t i = 0; i < n; i++) {                                   \
+            if (rec[i].op != 'L' && rec[i].op != 'S')                      \
+                continue;                                                  \
+            unsigned long address = rec[i].address;                        \
+            policy_access(cache, address >> (s + b),                       \
+                          (address >> b) & set_mask, rec[i].op == 'S',     \
+                          name##_hit, name##_fill, name##_victim);         \
+        }                                                                  \
+    }
+REPLACEMENT_POLICIES(DEFINE_POLICY)
+#undef DEFINE_POLICY
+
+/** @brief unlink an entry from one of the lists of its set. */
+static inline void node_unlink(int *prev, int *next, node_list_t *list,
+                               int node) {
+    int prev_node = prev[node];
+    int next_node = next[node];
+    if (prev_node >= 0)
+        next[prev_node] = next_node;
+    else
+        list->head = next_node;
+    if (next_node >= 0)
+        prev[next_node] = prev_node;
+    else
+        list->tail = prev_node;
+    list->size -= 1;
+}
+
+/** @brief link an entry at the head (MRU) of one of the lists of its set. */
+static inline void node_push(int *prev, int *next, node_list_t *list,
+                             int node) {
+    prev[node] = -1;
+    next[node] = list->head;
+    if (list->head >= 0)
+        prev[list->head] = node;
+    else
+        list->tail = node;
+    list->head = node;
+    list->size += 1;
+}
+
+/** @brief return the entry of (set, tag), resident or ghost, or -1. */
+static inline int node_find(cache_t *cache, unsigned long curr_tag,
+                            unsigned long curr_set_num) {
+    uint32_t slot = cache->hash_slot[hash_find(cache, curr_tag, curr_set_num)];
+    return slot != 0
+               ? (int)(slot - 1 - curr_set_num * (size_t)cache->nodes)
+               : -1;
+}
+
+/** @brief take an entry from the free list of the set, or a new one from
+ *         its pool, and enter it in the hash table under tag.
+ */
+static inline int node_alloc(cache_t *cache, queue_set_t *set,
+                             unsigned long curr_tag,
+                             unsigned long curr_set_num) {
+    int node = set->free_node;
+    if (node >= 0)
+        set->free_node = set->next[node];
+    else
+        node = set->curr_line_num++;
+    set->tag[node] = curr_tag;
+    size_t first = curr_set_num * (size_t)cache->nodes;
+    cache->hash_slot[hash_find(cache, curr_tag, curr_set_num)] =
+        (uint32_t)(first + (size_t)node + 1);
+    return node;
+}
+
+/** @brief drop an entry that is in no list from the hash table and put it
+ *         on the free list.
+ */
+static inline void node_forget(cache_t *cache, queue_set_t *set,
+                               unsigned long curr_set_num, int node) {
+    hash_remove(cache, hash_find(cache, set->tag[node], curr_set_num));
+    set->flags[node] = 0;
+    set->next[node] = set->free_node;
+    set->free_node = node;
+}
+
+/** @brief evict the resident line of an entry, which may stay as a ghost. */
+static inline void node_evict(cache_t *cache, queue_set_t *set, int node) {
+    evict_way(cache, set, node);
+    set->flags[node] = 0;
+}
+
+/** @brief ARC REPLACE: evict the LRU of T1 into B1 if T1 is above its
+ *         target size, or at it on a B2 ghost hit, else the LRU of T2 into
+ *         B2.
+ */
+static void arc_replace(cache_t *cache, queue_set_t *set, int b2_hit) {
+    node_list_t *list = set->lists;
+    int t1 = list[ARC_T1].size;
+    int from = t1 >= 1 && (t1 > set->target || (b2_hit && t1 == set->target))
+                   ? ARC_T1
+                   : ARC_T2;
+    if (list[from].size == 0)
+        from = from == ARC_T1 ? ARC_T2 : ARC_T1;
+    int to = from == ARC_T1 ? ARC_B1 : ARC_B2;
+    int victim = list[from].tail;
+    node_unlink(set->prev, set->next, &list[from], victim);
+    node_evict(cache, set, victim);
+    node_push(set->prev, set->next, &list[to], victim);
+    set->meta[victim] = (uint32_t)to;
+}
+
+/** @brief access a set managed by ARC, with E lines and up to E ghosts. */
+static void count_arc(cache_t *cache, unsigned long curr_tag,
+                      unsigned long curr_set_num, int dirty) {
+    queue_set_t *set = &cache->sets[curr_set_num];
+    node_list_t *list = set->lists;
+    int c = cache->E;
+    int node = node_find(cache, curr_tag, curr_set_num);
+    int from = node >= 0 ? (int)set->meta[node] : -1;
+    if (from == ARC_T1 || from == ARC_T2) {
+        cache->hit += 1;
+        if (dirty == 1)
+            set->flags[node] |= LINE_DIRTY;
+        node_unlink(set->prev, set->next, &list[from], node);
+        node_push(set->prev, set->next, &list[ARC_T2], node);
+        set->meta[node] = ARC_T2;
+        return;
+    }
+
+    cache->miss += 1;
+    int to = ARC_T2;
+    if (from == ARC_B1) {
+        // a recency ghost hit: T1 should have been larger
+        int delta = list[ARC_B2].size / list[ARC_B1].size;
+        set->target += delta > 1 ? delta : 1;
+        set->target = set->target < c ? set->target : c;
+        arc_replace(cache, set, 0);
+        node_unlink(set->prev, set->next, &list[ARC_B1], node);
+    } else if (from == ARC_B2) {
+        int delta = list[ARC_B1].size / list[ARC_B2].size;
+        set->target -= delta > 1 ? delta : 1;
+        set->target = set->target > 0 ? set->target : 0;
+        arc_replace(cache, set, 1);
+        node_unlink(set->prev, set->next, &list[ARC_B2], node);
+    } else {
+        to = ARC_T1;
+        int l1 = list[ARC_T1].size + list[ARC_B1].size;
+        int total = l1 + list[ARC_T2].size + list[ARC_B2].size;
+        int drop = -1;
+        if (l1 == c && list[ARC_T1].size < c) {
+            drop = ARC_B1;
+        } else if (l1 == c) {
+            // no room for a ghost of T1: its LRU line leaves for good
+            int victim = list[ARC_T1].tail;
+            node_unlink(set->prev, set->next, &list[ARC_T1], victim);
+            node_evict(cache, set, victim);
+            node_forget(cache, set, curr_set_num, victim);
+        } else if (total == 2 * c) {
+            drop = ARC_B2;
+        }
+        if (drop >= 0) {
+            int ghost = list[drop].tail;
+            node_unlink(set->prev, set->next, &list[drop], ghost);
+            node_forget(cache, set, curr_set_num, ghost);
+        }
+        if (drop >= 0 || (l1 < c && total >= c))
+            arc_replace(cache, set, 0);
+        node = node_alloc(cache, set, curr_tag, curr_set_num);
+    }
+    set->flags[node] = LINE_VALID | (dirty ? LINE_DIRTY : 0);
+    node_push(set->prev, set->next, &list[to], node);
+    set->meta[node] = (uint32_t)to;
+}
+
+/** @brief remove the HIR entries from the bottom of the LIRS stack, so
+ *         that it ends with a LIR block; ghosts leaving it are forgotten.
+ */
+static void lirs_prune(cache_t *cache, queue_set_t *set,
+                       unsigned long curr_set_num) {
+    node_list_t *list = set->lists;
+    int node;
+    while ((node = list[LIRS_STACK].tail) >= 0 &&
+           !(set->meta[node] & LIRS_LIR)) {
+        node_unlink(set->prev, set->next, &list[LIRS_STACK], node);
+        set->meta[node] &= ~(uint32_t)LIRS_IN_STACK;
+        if (!(set->flags[node] & LINE_VALID)) {
+            node_unlink(set->qprev, set->qnext, &list[LIRS_GHOSTS], node);
+            node_forget(cache, set, curr_set_num, node);
+        }
+    }
+}
+
+/** @brief make an entry the LIR block on top of the stack, turning the LIR
+ *         block at the bottom into a resident HIR block at the end of the
+ *         queue.
+ */
+static void lirs_promote(cache_t *cache, queue_set_t *set,
+                         unsigned long curr_set_num, int node) {
+    node_list_t *list = set->lists;
+    node_unlink(set->prev, set->next, &list[LIRS_STACK], node);
+    node_push(set->prev, set->next, &list[LIRS_STACK], node);
+    set->meta[node] = LIRS_LIR | LIRS_IN_STACK;
+    int bottom = list[LIRS_STACK].tail;
+    node_unlink(set->prev, set->next, &list[LIRS_STACK], bottom);
+    set->meta[bottom] = 0;
+    node_push(set->qprev, set->qnext, &list[LIRS_QUEUE], bottom);
+    lirs_prune(cache, set, curr_set_num);
+}
+
+/** @brief access a set managed by LIRS. The set holds E lines, of which
+ *         LIRS_HIR_PERCENT (at least one) are resident HIR blocks, and up
+ *         to E ghosts.
+ */
+static void count_lirs(cache_t *cache, unsigned long curr_tag,
+                       unsigned long curr_set_num, int dirty) {
+    queue_set_t *set = &cache->sets[curr_set_num];
+    node_list_t *list = set->lists;
+    int hirs = cache->E * LIRS_HIR_PERCENT / 100;
+    int lirs = cache->E - (hirs > 1 ? hirs : 1);
+    int node = node_find(cache, curr_tag, curr_set_num);
+    if (node >= 0 && (set->flags[node] & LINE_VALID)) {
+        cache->hit += 1;
+        if (dirty == 1)
+            set->flags[node] |= LINE_DIRTY;
+        if (set->meta[node] & LIRS_LIR) {
+            node_unlink(set->prev, set->next, &list[LIRS_STACK], node);
+            node_push(set->prev, set->next, &list[LIRS_STACK], node);
+            lirs_prune(cache, set, curr_set_num);
+        } else if (set->meta[node] & LIRS_IN_STACK) {
+            node_unlink(set->qprev, set->qnext, &list[LIRS_QUEUE], node);
+            lirs_promote(cache, set, curr_set_num, node);
+        } else {
+            node_push(set->prev, set->next, &list[LIRS_STACK], node);
+            set->meta[node] |= LIRS_IN_STACK;
+            node_unlink(set->qprev, set->qnext, &list[LIRS_QUEUE], node);
+            node_push(set->qprev, set->qnext, &list[LIRS_QUEUE], node);
+        }
+        return;
+    }
+
+    cache->miss += 1;
+    // the first blocks of the set fill its LIR part
+    if (node < 0 && set->target < lirs) {
+        node = node_alloc(cache, set, curr_tag, curr_set_num);
+        set->flags[node] = LINE_VALID | (dirty ? LINE_DIRTY : 0);
+        set->meta[node] = LIRS_LIR | LIRS_IN_STACK;
+        node_push(set->prev, set->next, &list[LIRS_STACK], node);
+        set->target += 1;
+        return;
+    }
+    // a ghost is always in the stack; it stops being a ghost
+    if (node >= 0)
+        node_unlink(set->qprev, set->qnext, &list[LIRS_GHOSTS], node);
+    if (set->target + list[LIRS_QUEUE].size >= cache->E) {
+        int victim = list[LIRS_QUEUE].tail;
+        node_unlink(set->qprev, set->qnext, &list[LIRS_QUEUE], victim);
+        node_evict(cache, set, victim);
+        if (set->meta[victim] & LIRS_IN_STACK) {
+            node_push(set->qprev, set->qnext, &list[LIRS_GHOSTS], victim);
+        } else {
+            node_forget(cache, set, curr_set_num, victim);
+        }
+        // the oldest ghost leaves once there are more ghosts than lines
+        if (list[LIRS_GHOSTS].size > cache->E) {
+            int ghost = list[LIRS_GHOSTS].tail;
+            node_unlink(set->qprev, set->qnext, &list[LIRS_GHOSTS], ghost);
+            node_unlink(set->prev, set->next, &list[LIRS_STACK], ghost);
+            node_forget(cache, set, curr_set_num, ghost);
+        }
+    }
+    if (node >= 0) {
+        set->flags[node] = LINE_VALID | (dirty ? LINE_DIRTY : 0);
+        lirs_promote(cache, set, curr_set_num, node);
+        return;
+    }
+    node = node_alloc(cache, set, curr_tag, curr_set_num);
+    set->flags[node] = LINE_VALID | (dirty ? LINE_DIRTY : 0);
+    set->meta[node] = LIRS_IN_STACK;
+    node_push(set->prev, set->next, &list[LIRS_STACK], node);
+    node_push(set->qprev, set->qnext, &list[LIRS_QUEUE], node);
+}
+
+/* Batch kernels of the policies that manage their own entries */
+#define DEFINE_COUNT_KERNEL(name)                                          \
+    static void kernel_##name(cache_t *cache, const trace_record_t *rec,   \
+                              size_t n) {                                  \
+        int s = cache->s, b = cache->b;                                    \
+        unsigned long set_mask = (unsigned long)(cache->S - 1);            \
+        for (size_t i = 0; i < n; i++) {                                   \
+            if (rec[i].op != 'L' && rec[i].op != 'S')                      \
+                continue;                                                  \
+            unsigned long address = rec[i].address;                        \
+            count_##name(cache, address >> (s + b),                        \
+                         (address >> b) & set_mask, rec[i].op == 'S');     \
+        }                                                                  \
+    }
+DEFINE_COUNT_KERNEL(arc)
+DEFINE_COUNT_KERNEL(lirs)
+#undef DEFINE_COUNT_KERNEL
+
+/** @brief update the number of hit, miss, eviction and dirty eviction of
+ *         the cache with the policy and engine it was created with.
+ *
+ *  @param[in]     cache          Pointer to the initialized cache.
+ *  @param[in]     curr_tag       Tag bits computed using the address.
+ *  @param[in]     curr_set_num   Set index computed using the address.
+ *  @param[in]     dirty          Set to 0 if it's a load operation,
+ *                                to 1 if it's a store operation.
+ */
+void count(cache_t *cache, unsigned long curr_tag, unsigned long curr_set_num,
+           int dirty) {
+    switch (cache->policy) {
+    case POLICY_FIFO:
+        count_fifo(cache, curr_tag, curr_set_num, dirty);
+        return;
+    case POLICY_RANDOM:
+        count_random(cache, curr_tag, curr_set_num, dirty);
+        return;
+    case POLICY_LFU:
+        count_lfu(cache, curr_tag, curr_set_num, dirty);
+        return;
+    case POLICY_NRU:
+        count_nru(cache, curr_tag, curr_set_num, dirty);
+        return;
+    case POLICY_PLRU:
+        count_plru(cache, curr_tag, curr_set_num, dirty);
+        return;
+    case POLICY_SRRIP:
+        count_srrip(cache, curr_tag, curr_set_num, dirty);
+        return;
+    case POLICY_BRRIP:
+        count_brrip(cache, curr_tag, curr_set_num, dirty);
+        return;
+    case POLICY_DRRIP:
+        count_drrip(cache, curr_tag, curr_set_num, dirty);
+        return;
+    case POLICY_OPT:
+        count_opt(cache, curr_tag, curr_set_num, dirty);
+        return;
+    case POLICY_HAWKEYE:
+        count_hawkeye(cache, curr_tag, curr_set_num, dirty);
+        return;
+    case POLICY_ARC:
+        count_arc(cache, curr_tag, curr_set_num, dirty);
+        return;
+    case POLICY_LIRS:
+        count_lirs(cache, curr_tag, curr_set_num, dirty);
+        return;
+    default:
+        break;
+    }
+    switch (cache->engine) {
+    case ENGINE_DIRECT:
+        direct_access(cache, curr_tag, curr_set_num, dirty);
+        break;
+    case ENGINE_AGE:
+        count_age(cache, curr_tag, curr_set_num, dirty);
+        break;
+    case ENGINE_MATRIX:
+        count_matrix(cache, curr_tag, curr_set_num, dirty);
+        break;
+    case ENGINE_HASH:
+        count_hash(cache, curr_tag, curr_set_num, dirty);
+        break;
+    default:
+        count_list(cache, curr_tag, curr_set_num, dirty);
+        break;
+    }
+}
+
+/** @brief simulate a batch with the engine selected for the cache,
+ *         computing the tag and set index of every record at runtime.
+ */
+static void kernel_generic(cache_t *cache, const trace_record_t *rec,
+                           size_t n) {
+    int s = cache->s, b = cache->b;
+    unsigned long set_mask = (unsigned long)(cache->S - 1);
+    for (size_t i = 0; i < n; i++) {
+        if (rec[i].op != 'L' && rec[i].op != 'S')
+            continue;
+        unsigned long address = rec[i].address;
+        count(cache, address >> (s + b), (address >> b) & set_mask,
+              rec[i].op == 'S');
+    }
+}
+
+/** @brief return the flags of a block cached in a set, or NULL if the
+ *         block is not cached. The cache must not be direct-mapped.
+ */
+static unsigned char *line_flags(cache_t *cache, unsigned long curr_tag,
+                                 unsigned long curr_set_num) {
+    queue_set_t *set = &cache->sets[curr_set_num];
+    if (cache->engine == ENGINE_HASH || cache->policy == POLICY_ARC ||
+        cache->policy == POLICY_LIRS) {
+        // ghosts of ARC and LIRS are in the table with their flags cleared
+        uint32_t slot =
+            cache->hash_slot[hash_find(cache, curr_tag, curr_set_num)];
+        if (slot == 0)
+            return NULL;
+        unsigned char *flags =
+            &set->flags[slot - 1 - curr_set_num * (size_t)cache->nodes];
+        return *flags & LINE_VALID ? flags : NULL;
+    }
+    int way = match_tag(set->tag, set->flags, set->curr_line_num, curr_tag);
+    return way >= 0 ? &set->flags[way] : NULL;
+}
+
+/** @brief check whether a block is cached, without touching the
+ *         replacement state.
+ */
+static int cache_holds(cache_t *cache, unsigned long curr_tag,
+                       unsigned long curr_set_num) {
+    if (cache->engine == ENGINE_DIRECT) {
+        uint64_t bit = (uint64_t)1 << (curr_set_num % 64);
+        return cache->line_tag[curr_set_num] == curr_tag &&
+               (cache->line_valid[curr_set_num / 64] & bit) != 0;
+    }
+    return line_flags(cache, curr_tag, curr_set_num) != NULL;
+}
+
+/** @brief simulate one access under the write policy of the cache. A
+ *         write-through store leaves the line clean and sends its bytes
+ *         to the next level; a store missing a no-write-allocate cache
+ *         only counts the miss and goes to the next level, and a
+ *         write-back one keeps nothing to flush for it later.
+ *
+ *  @param[in]     cache          Pointer to the initialized cache.
+ *  @param[in]     curr_tag       Tag bits computed using the address.
+ *  @param[in]     curr_set_num   Set index computed using the address.
+ *  @param[in]     store          Set to 1 for a store, 0 for a load.
+ *  @param[in]     size           Number of bytes accessed.
+ *  @return 1 on a hit, 0 on a miss that filled the line, -1 on a store
+ *          miss that bypassed the cache.
+ */
+static int count_write(cache_t *cache, unsigned long curr_tag,
+                       unsigned long curr_set_num, int store,
+                       uint32_t size) {
+    int through = store && (cache->write & WRITE_THROUGH);
+    if (through)
+        cache->write_bytes += size;
+    if (store && (cache->write & WRITE_NO_ALLOCATE) &&
+        !cache_holds(cache, curr_tag, curr_set_num)) {
+        cache->miss += 1;
+        if (!through)
+            cache->write_bytes += size;
+        // the access still has a position in the next-use file
+        if (cache->policy == POLICY_OPT)
+            cache->opt_pos += 1;
+        return -1;
+    }
+    unsigned long hit = cache->hit;
+    cache->evicted = 0;
+    count(cache, curr_tag, curr_set_num, store && !through);
+    return cache->hit != hit;
+}
+
+/** @brief simulate a batch on a cache that is not write-back with
+ *         write-allocate.
+ */
+static void kernel_write(cache_t *cache, const trace_record_t *rec,
+                         size_t n) {
+    int s = cache->s, b = cache->b;
+    unsigned long set_mask = (unsigned long)(cache->S - 1);
+    for (size_t i = 0; i < n; i++) {
+        if (rec[i].op != 'L' && rec[i].op != 'S')
+            continue;
+        unsigned long address = rec[i].address;
+        count_write(cache, address >> (s + b), (address >> b) & set_mask,
+                    rec[i].op == 'S', rec[i].size);
+    }
+}
+
+/** @brief bytes a cache wrote to the next level: its write-through and
+ *         bypassing stores, its dirty evictions, and the dirty lines
+ *         flushed when it was freed.
+ */
+unsigned long write_traffic(const cache_t *cache) {
+    return cache->write_bytes +
+           (cache->dirty_eviction + cache->dirty_count) *
+               (unsigned long)cache->B;
+}
+
+/* Block bits argument of a kernel that reads b from the cache */
+#define RUNTIME_BITS (-1)
+
+/** @brief simulate a batch on the age engine. E and, unless it is
+ *         RUNTIME_BITS, b are compile-time constants in the kernels
+ *         generated below.
+ */
+static ALWAYS_INLINE void simulate_age(cache_t *cache,
+                                       const trace_record_t *rec, size_t n,
+                                       int E, int block_bits) {
+    int b = block_bits == RUNTIME_BITS ? cache->b : block_bits;
+    int tag_shift = cache->s + b;
+    unsigned long set_mask = (unsigned long)(cache->S - 1);
+    for (size_t i = 0; i < n; i++) {
+        int op = rec[i].op;
+        if (op != 'L' && op != 'S')
+            continue;
+        unsigned long address = rec[i].address;
+        queue_set_t *set = &cache->sets[(address >> b) & set_mask];
+        age_access(cache, set, address >> tag_shift, op == 'S', E);
+    }
+}
+
+/** @brief simulate a batch on the direct-mapped engine, with b a
+ *         compile-time constant unless it is RUNTIME_BITS.
+ */
+static ALWAYS_INLINE void simulate_direct(cache_t *cache,
+                                          const trace_record_t *rec,
+                                          size_t n, int block_bits) {
+    int b = block_bits == RUNTIME_BITS ? cache->b : block_bits;
+    int tag_shift = cache->s + b;
+    unsigned long set_mask = (unsigned long)(cache->S - 1);
+    for (size_t i = 0; i < n; i++) {
+        int op = rec[i].op;
+        if (op != 'L' && op != 'S')
+            continue;
+        unsigned long address = rec[i].address;
+        direct_access(cache, address >> tag_shift, (address >> b) & set_mask,
+                      op == 'S');
+    }
+}
+
+static void kernel_direct_b6(cache_t *cache, const trace_record_t *rec,
+                             size_t n) {
+    simulate_direct(cache, rec, n, 6);
+}
+
+static void kernel_direct_bx(cache_t *cache, const trace_record_t *rec,
+                             size_t n) {
+    simulate_direct(cache, rec, n, RUNTIME_BITS);
+}
+
+/** Geometries that get a specialised kernel, as (E, block bits, name).
+ *  The nightly sweeps use 64-byte blocks, other block sizes still get the
+ *  associativity specialised.
+ */
+#define KERNEL_GEOMETRIES(X)                                               \
+    X(1, 6, b6)                                                            \
+    X(2, 6, b6)                                                            \
+    X(4, 6, b6)                                                            \
+    X(8, 6, b6)                                                            \
+    X(16, 6, b6)                                                           \
+    X(1, RUNTIME_BITS, bx)                                                 \
+    X(2, RUNTIME_BITS, bx)                                                 \
+    X(4, RUNTIME_BITS, bx)                                                 \
+    X(8, RUNTIME_BITS, bx)                                                 \
+    X(16, RUNTIME_BITS, bx)
+
+#define DEFINE_AGE_KERNEL(ways, block_bits, name)                          \
+    static void kernel_age_E##ways##_##name(                               \
+        cache_t *cache, const trace_record_t *rec, size_t n) {             \
+        simulate_age(cache, rec, n, ways, block_bits);                     \
+    }
+KERNEL_GEOMETRIES(DEFINE_AGE_KERNEL)
+#undef DEFINE_AGE_KERNEL
+
+#define AGE_KERNEL_ENTRY(ways, block_bits, name)                           \
+    {ways, block_bits, kernel_age_E##ways##_##name},
+static const struct {
+    int E;
+    int b;
+    sim_kernel_t kernel;
+} age_kernels[] = {KERNEL_GEOMETRIES(AGE_KERNEL_ENTRY)};
+#undef AGE_KERNEL_ENTRY
+
+/** @brief pick the most specialised kernel for the geometry, policy and
+ *         engine of
+ *         the cache, falling back to kernel_generic().
+ */
+static void init_kernel(cache_t *cache) {
+    cache->kernel = kernel_generic;
+    if (cache->prefetcher != NULL) {
+        cache->kernel = kernel_prefetch;
+        return;
+    }
+    if (cache->write != 0) {
+        cache->kernel = kernel_write;
+        return;
+    }
+    switch (cache->policy) {
+    case POLICY_FIFO:
+        cache->kernel = kernel_fifo;
+        return;
+    case POLICY_RANDOM:
+        cache->kernel = kernel_random;
+        return;
+    case POLICY_LFU:
+        cache->kernel = kernel_lfu;
+        return;
+    case POLICY_NRU:
+        cache->kernel = kernel_nru;
+        return;
+    case POLICY_PLRU:
+        cache->kernel = kernel_plru;
+        return;
+    case POLICY_SRRIP:
+        cache->kernel = kernel_srrip;
+        return;
+    case POLICY_BRRIP:
+        cache->kernel = kernel_brrip;
+        return;
+    case POLICY_DRRIP:
+        cache->kernel = kernel_drrip;
+        return;
+    case POLICY_OPT:
+        cache->kernel = kernel_opt;
+        return;
+    case POLICY_HAWKEYE:
+        cache->kernel = kernel_hawkeye;
+        return;
+    case POLICY_ARC:
+        cache->kernel = kernel_arc;
+        return;
+    case POLICY_LIRS:
+        cache->kernel = kernel_lirs;
+        return;
+    default:
+        break;
+    }
+    if (cache->engine == ENGINE_DIRECT) {
+        cache->kernel = cache->b == 6 ? kernel_direct_b6 : kernel_direct_bx;
+        return;
+    }
+    if (cache->engine != ENGINE_AGE)
+        return;
+    size_t n = sizeof(age_kernels) / sizeof(age_kernels[0]);
+    // an exact block size match comes first in the table
+    for (size_t i = 0; i < n; i++) {
+        if (age_kernels[i].E == cache->E &&
+            (age_kernels[i].b == cache->b ||
+             age_kernels[i].b == RUNTIME_BITS)) {
+            cache->kernel = age_kernels[i].kernel;
+            return;
+        }
+    }
+}
+
+/** @brief free cache while counting how many dirty bits exist,
+ *         store in the cache counter dirty_count
+ *
+ *  @param[in]     cache     Pointer to the initialized cache.
+ */
+void free_cache(cache_t *cache) {
+    if (cache->engine == ENGINE_DIRECT && cache->block != NULL) {
+        for (size_t i = 0; i < ((size_t)cache->S + 63) / 64; i++)
+            cache->dirty_count +=
+                (unsigned long)__builtin_popcountll(cache->line_dirty[i]);
+    } else if (cache->sets != NULL) {
+        for (int i = 0; i < cache->S; i++) {
+            queue_set_t *set = &cache->sets[i];
+            for (int j = 0; j < set->curr_line_num; j++) {
+                if (set->flags[j] & LINE_DIRTY)
+                    cache->dirty_count += 1;
+            }
+        }
+    }
+    free_prefetcher(cache);
+    // the sets and every way live in the same block
+    free(cache->block);
+    cache->block = NULL;
+    cache->sets = NULL;
+}
+
+/** A trace being read: the whole file is mapped and decoded into a batch
+ *  of records at a time.
+ */
+typedef struct trace_reader {
+    const char *data;      /* mapped trace file, or the stream buffer */
+    size_t size;           /* size of the file, or bytes in the buffer */
+    size_t pos;            /* offset of the next line or record to decode */
+    int binary;            /* whether the file is a binary trace */
+    int fd;                /* stream read as it arrives, -1 if mapped */
+    int eof;               /* whether the stream has ended */
+    int error;             /* whether reading the stream failed */
+    trace_record_t *batch; /* RECORD_BATCH decoded records */
+} trace_reader_t;
+
+/* Buffer of a stream */
+#define STREAM_BUFFER (1 << 20)
+
+/* Bytes the fast decoder may read past the start of an address */
+#define PARSE_LOOKAHEAD 48
+
+/** @brief load 8 bytes as a little-endian word. */
+static inline uint64_t load_le64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+/** @brief decode up to 8 hex digits held in a word, the first digit in the
+ *         lowest byte and missing leading digits as zero bytes. Every byte
+ *         is turned into its nibble, then pairs of lanes are merged until
+ *         one 32-bit value is left.
+ */
+static inline uint64_t swar_hex8(uint64_t chunk) {
+    // '0'-'9' keep their low nibble, 'a'-'f'/'A'-'F' have bit 6 set and
+    // need 9 more
+    uint64_t v = (chunk & 0x0f0f0f0f0f0f0f0fULL) +
+                 9 * ((chunk >> 6) & 0x0101010101010101ULL);
+    v = ((v & 0x000f000f000f000fULL) << 4) |
+        ((v >> 8) & 0x000f000f000f000fULL);
+    v = ((v & 0x000000ff000000ffULL) << 8) |
+        ((v >> 16) & 0x000000ff000000ffULL);
+    return ((v & 0xffff) << 16) | ((v >> 32) & 0xffff);
+}
+
+/** @brief decode the n (1 to 16) hex digits starting at p; 8 bytes are
+ *         loaded for each half, so p must have 8 readable bytes past them.
+ */
+static inline uint64_t decode_hex(const char *p, int n) {
+    if (n <= 8)
+        return swar_hex8(load_le64(p) << (8 * (8 - n)));
+    uint64_t high = swar_hex8(load_le64(p) << (8 * (16 - n)));
+    return (high << 32) | swar_hex8(load_le64(p + n - 8));
+}
+
+/** @brief return the value of a hex digit, or -1 if c is not one. */
+static inline int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/** @brief count the hex digits at the start of the 16 bytes at p. */
+static inline int hex_run16(const char *p) {
+#ifdef HAVE_X86_SIMD
+    __m128i c = _mm_loadu_si128((const __m128i *)p);
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                  _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i letter =
+        _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                      _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    unsigned int hex =
+        (unsigned int)_mm_movemask_epi8(_mm_or_si128(digit, letter));
+    return __builtin_ctz(~hex);
+#else
+    int n = 0;
+    while (n < 16 && hex_value(p[n]) >= 0)
+        n++;
+    return n;
+#endif
+}
+
+/** @brief decode the line starting at *pp into rec and advance *pp to the
+ *         next line.
+ *
+ *  @param[in,out] pp        Start of the line, then of the next one.
+ *  @param[in]     end       End of the mapped trace.
+ *  @param[out]    rec       Decoded record.
+ *  @return 1 if the line is a load or a store, 0 if it was skipped.
+ */
+static inline int parse_line(const char **pp, const char *end,
+                             trace_record_t *rec) {
+    const char *p = *pp;
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    char op = p < end ? *p : '\n';
+    int ok = 0;
+    if (op == 'L' || op == 'S') {
+        p++;
+        while (p < end && *p == ' ')
+            p++;
+        // measured from the digits, as blanks may run up to the end
+        int fast = end - p >= PARSE_LOOKAHEAD;
+        uint64_t address = 0;
+        if (fast) {
+            int n = hex_run16(p);
+            if (n > 0)
+                address = decode_hex(p, n);
+            ok = n > 0;
+            p += n;
+        } else {
+            const char *digits = p;
+            for (int v; p < end && p - digits < 16 && (v = hex_value(*p)) >= 0;
+                 p++)
+                address = (address << 4) | (uint64_t)v;
+            ok = p > digits;
+        }
+        uint32_t size = 0;
+        if (p < end && *p == ',') {
+            for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+                size = size * 10 + (uint32_t)(*p - '0');
+        }
+        // an optional third field is the core of a multi-threaded trace
+        unsigned int core = 0;
+        if (p < end && *p == ',') {
+            for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+                core = core * 10 + (unsigned int)(*p - '0');
+        }
+        rec->address = address;
+        rec->size = size;
+        rec->op = (uint8_t)op;
+        rec->core = (uint8_t)(core < 256 ? core : 255);
+    }
+    const char *eol = p < end ? memchr(p, '\n', (size_t)(end - p)) : NULL;
+    *pp = eol != NULL ? eol + 1 : end;
+    return ok;
+}
+
+/** @brief convert between little-endian and host byte order. */
+static inline uint64_t le64(uint64_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t le32(uint32_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+void close_trace(trace_reader_t *reader);
+
+/** @brief move the undecoded bytes of a stream to the front of its buffer
+ *         and read until it holds at least need of them or the stream
+ *         ends. Each read takes whatever has arrived, so a live trace is
+ *         followed as it is written rather than once the buffer is full.
+ *
+ *  @param[in]     reader    Stream being read.
+ *  @param[in]     need      Undecoded bytes wanted, at most STREAM_BUFFER.
+ *  @return 0 on success, -1 on a read error.
+ */
+static int refill_stream(trace_reader_t *reader, size_t need) {
+    char *buffer = (char *)reader->data;
+    size_t left = reader->size - reader->pos;
+    memmove(buffer, buffer + reader->pos, left);
+    reader->pos = 0;
+    reader->size = left;
+    while (!reader->eof && reader->size < need) {
+        ssize_t got = read(reader->fd, buffer + reader->size,
+                           STREAM_BUFFER - reader->size);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return -1;
+        if (got == 0)
+            reader->eof = 1;
+        reader->size += (size_t)got;
+    }
+    return 0;
+}
+
+/** @brief return the end of the last complete line of a stream buffer, or
+ *         NULL if it holds no newline past p.
+ */
+static const char *last_line_end(const char *p, const char *end) {
+    while (end > p && end[-1] != '\n')
+        end--;
+    return end > p ? end : NULL;
+}
+
+/** @brief open a trace for sequential reading. A regular file is mapped
+ *         whole; a pipe, or standard input given as "-", is read into a
+ *         buffer as it arrives so that a live trace can be followed. A
+ *         trace starting with TRACE_MAGIC is read as a binary trace, any
+ *         other as text.
+ *
+ *  @param[out]    reader    Reader to initialize.
+ *  @param[in]     path      Path to the trace file, "-" for stdin.
+ *  @return 0 on success, -1 if the trace could not be opened or mapped.
+ */
+int open_trace(trace_reader_t *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = -1;
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (S_ISREG(st.st_mode)) {
+        reader->size = (size_t)st.st_size;
+        if (reader->size > 0) {
+            void *data =
+                mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                return -1;
+            }
+            madvise(data, reader->size, MADV_SEQUENTIAL);
+            reader->data = data;
+        }
+        close(fd);
+    } else {
+        reader->fd = fd;
+        reader->data = malloc(STREAM_BUFFER);
+        if (reader->data == NULL ||
+            refill_stream(reader, sizeof(trace_header_t)) != 0) {
+            close_trace(reader);
+            return -1;
+        }
+    }
+
+    // a binary trace starts with its header and holds exactly count
+    // records; the count of a stream is only known once it ends
+    trace_header_t header;
+    if (reader->size >= sizeof(header) &&
+        memcmp(reader->data, TRACE_MAGIC, sizeof(header.magic)) == 0) {
+        memcpy(&header, reader->data, sizeof(header));
+        if (le32(header.version) != TRACE_VERSION ||
+            le32(header.record_size) != sizeof(trace_record_t) ||
+            (reader->fd < 0 &&
+             (reader->size - sizeof(header)) / sizeof(trace_record_t) !=
+                 le64(header.count))) {
+            close_trace(reader);
+            return -1;
+        }
+        reader->binary = 1;
+        reader->pos = sizeof(header);
+    }
+    reader->batch = malloc(RECORD_BATCH * sizeof(trace_record_t));
+    return reader->batch == NULL ? -1 : 0;
+}
+
+/** @brief decode the next batch of loads and stores. Batches of a mapped
+ *         binary trace point straight into the mapping on little-endian
+ *         hosts. A stream only waits for more input when nothing complete
+ *         is buffered, so a batch may be short.
+ *
+ *  @param[in]     reader    Opened trace.
+ *  @param[out]    batch     Decoded records, valid until the next call.
+ *  @return number of records in the batch, 0 at the end of the trace or
+ *          on a read error, which sets reader->error.
+ */
+size_t read_batch(trace_reader_t *reader, const trace_record_t **batch) {
+    size_t n = 0;
+    *batch = reader->batch;
+    if (reader->error)
+        return 0;
+    if (reader->binary) {
+        if (reader->fd >= 0 && !reader->eof &&
+            reader->size - reader->pos < sizeof(trace_record_t) &&
+            refill_stream(reader, sizeof(trace_record_t)) != 0) {
+            reader->error = 1;
+            return 0;
+        }
+        size_t left = (reader->size - reader->pos) / sizeof(trace_record_t);
+        n = left < RECORD_BATCH ? left : RECORD_BATCH;
+        const trace_record_t *rec =
+            (const trace_record_t *)(reader->data + reader->pos);
+        reader->pos += n * sizeof(trace_record_t);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        if (reader->fd < 0) {
+            *batch = rec;
+            return n;
+        }
+#endif
+        // the stream buffer is reused, so its records are copied
+        memcpy(reader->batch, rec, n * sizeof(trace_record_t));
+        for (size_t i = 0; i < n; i++) {
+            reader->batch[i].address = le64(reader->batch[i].address);
+            reader->batch[i].size = le32(reader->batch[i].size);
+        }
+        return n;
+    }
+    while (n < RECORD_BATCH) {
+        const char *p = reader->data + reader->pos;
+        const char *end = reader->data + reader->size;
+        // a stream only decodes complete lines, and reads more once none
+        // is left; a line longer than the whole buffer is cut
+        const char *stop = end;
+        if (reader->fd >= 0 && !reader->eof) {
+            stop = last_line_end(p, end);
+            if (stop == NULL && n > 0)
+                break;
+            if (stop == NULL && end - p < STREAM_BUFFER) {
+                if (refill_stream(reader, (size_t)(end - p) + 1) != 0) {
+                    reader->error = 1;
+                    break;
+                }
+                continue;
+            }
+            if (stop == NULL)
+                stop = end;
+        }
+        if (p == end)
+            break;
+        while (n < RECORD_BATCH && p < stop)
+            n += (size_t)parse_line(&p, stop, &reader->batch[n]);
+        reader->pos = (size_t)(p - reader->data);
+    }
+    return n;
+}
+
+/** @brief unmap or close the trace and free the batch. */
+void close_trace(trace_reader_t *reader) {
+    if (reader->fd >= 0) {
+        free((void *)reader->data);
+        if (reader->fd != STDIN_FILENO)
+            close(reader->fd);
+    } else if (reader->data != NULL) {
+        munmap((void *)reader->data, reader->size);
+    }
+    free(reader->batch);
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = -1;
+}
+
+/** @brief write every record of a trace to a binary trace.
+ *
+ *  @param[in]     reader    Opened trace, read until its end.
+ *  @param[in]     path      Path of the binary trace to create.
+ *  @return number of records written, or -1 if the file could not be
+ *          written.
+ */
+long convert_trace(trace_reader_t *reader, const char *path) {
+    FILE *out = fopen(path, "wb");
+    if (out == NULL)
+        return -1;
+    trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = le32(TRACE_VERSION);
+    header.record_size = le32(sizeof(trace_record_t));
+
+    // the count is only known at the end, the header is written twice
+    int ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    const trace_record_t *batch;
+    size_t n;
+    uint64_t count = 0;
+    while (ok && (n = read_batch(reader, &batch)) > 0) {
+        trace_record_t le[RECORD_BATCH];
+        for (size_t i = 0; i < n; i++) {
+            le[i] = batch[i];
+            le[i].address = le64(batch[i].address);
+            le[i].size = le32(batch[i].size);
+            memset(le[i].pad, 0, sizeof(le[i].pad));
+        }
+        ok = fwrite(le, sizeof(trace_record_t), n, out) == n;
+        count += n;
+    }
+    header.count = le64(count);
+    ok = ok && fseek(out, 0, SEEK_SET) == 0 &&
+         fwrite(&header, sizeof(header), 1, out) == 1;
+    if (fclose(out) != 0 || !ok)
+        return -1;
+    return (long)count;
+}
+
+/* Records per chunk and chunks per queue between the router and a shard */
+#define SHARD_CHUNK 1024
+#define SHARD_QUEUE 8
+
+/** A chunk of records routed to one shard */
+typedef struct {
+    size_t n;
+    trace_record_t rec[SHARD_CHUNK];
+} shard_chunk_t;
+
+/** Lock-free single-producer single-consumer queue of chunks. The router
+ *  fills the chunk at tail in place and publishes it by moving tail; the
+ *  shard consumes the chunk at head and releases it by moving head.
+ */
+typedef struct {
+    shard_chunk_t chunk[SHARD_QUEUE];
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    _Atomic int done; /* set once the router published its last chunk */
+} shard_queue_t;
+
+/** A worker simulating the sets whose low set bits equal its index */
+typedef struct {
+    cache_t cache;
+    shard_queue_t *queue;
+    pthread_t thread;
+} shard_t;
+
+/** @brief simulate every chunk published to the shard until the router is
+ *         done.
+ */
+static void *run_shard(void *arg) {
+    shard_t *shard = arg;
+    shard_queue_t *queue = shard->queue;
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    for (;;) {
+        if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+            // check done before tail again so the last chunk is not lost
+            if (atomic_load_explicit(&queue->done, memory_order_acquire) &&
+                head == atomic_load_explicit(&queue->tail,
+                                             memory_order_acquire))
+                break;
+            sched_yield();
+            continue;
+        }
+        shard_chunk_t *chunk = &queue->chunk[head % SHARD_QUEUE];
+        shard->cache.kernel(&shard->cache, chunk->rec, chunk->n);
+        head += 1;
+        atomic_store_explicit(&queue->head, head, memory_order_release);
+    }
+    return NULL;
+}
+
+/** @brief wait until the chunk at the tail of the queue is free. */
+static shard_chunk_t *shard_reserve(shard_queue_t *queue) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&queue->head, memory_order_acquire) ==
+           SHARD_QUEUE)
+        sched_yield();
+    return &queue->chunk[tail % SHARD_QUEUE];
+}
+
+/** @brief publish the chunk at the tail of the queue to the shard. */
+static void shard_publish(shard_queue_t *queue) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
+
+/** @brief simulate the trace with the sets split across worker threads.
+ *         Sets never interact, so shard i owns the sets whose low bits are
+ *         i and simulates them as a cache with fewer set bits; the router
+ *         drops those bits from every address before handing it over. The
+ *         counters of the shards are merged into total, which matches a
+ *         serial run exactly.
+ *
+ *  @param[in]     reader    Opened trace, read until its end.
+ *  @param[in]     s, E, b   Geometry of the cache.
+ *  @param[in]     options   Engine and policy of every shard.
+ *  @param[in]     jobs      Requested number of workers; the largest power
+ *                           of two not above it and S is used.
+ *  @param[out]    total     Geometry and merged counters, already freed.
+ *  @return 0 on success, -1 if a shard could not be created.
+ */
+int simulate_sharded(trace_reader_t *reader, int s, int E, int b,
+                     const cache_options_t *options, int jobs,
+                     cache_t *total) {
+    int k = 0;
+    while (k < s && (2 << k) <= jobs)
+        k++;
+    int shards = 1 << k;
+    shard_t *shard = calloc((size_t)shards, sizeof(shard_t));
+    size_t size = (size_t)shards * sizeof(shard_queue_t);
+    shard_queue_t *queue = aligned_alloc(64, (size + 63) & ~(size_t)63);
+    if (shard == NULL || queue == NULL) {
+        free(shard);
+        free(queue);
+        return -1;
+    }
+    int created = 0;
+    int status = 0;
+    for (int i = 0; i < shards; i++) {
+        atomic_init(&queue[i].head, 0);
+        atomic_init(&queue[i].tail, 0);
+        atomic_init(&queue[i].done, 0);
+        shard[i].queue = &queue[i];
+        if (init_cache(&shard[i].cache, s - k, E, b, options) != 0) {
+            status = -1;
+            break;
+        }
+        if (pthread_create(&shard[i].thread, NULL, run_shard, &shard[i]) !=
+            0) {
+            free_cache(&shard[i].cache);
+            status = -1;
+            break;
+        }
+        created++;
+    }
+
+    // route every record to the shard owning its set
+    shard_chunk_t **fill = calloc((size_t)shards, sizeof(*fill));
+    if (fill == NULL)
+        status = -1;
+    const trace_record_t *batch;
+    size_t n;
+    unsigned long set_mask = (1UL << s) - 1;
+    unsigned long shard_mask = (unsigned long)shards - 1;
+    unsigned long offset_mask = (1UL << b) - 1;
+    while (status == 0 && (n = read_batch(reader, &batch)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            unsigned long address = batch[i].address;
+            unsigned long set_num = (address >> b) & set_mask;
+            unsigned long tag = address >> (s + b);
+            int owner = (int)(set_num & shard_mask);
+            if (fill[owner] == NULL) {
+                fill[owner] = shard_reserve(&queue[owner]);
+                fill[owner]->n = 0;
+            }
+            trace_record_t *rec = &fill[owner]->rec[fill[owner]->n++];
+            *rec = batch[i];
+            rec->address = (tag << (s - k + b)) | ((set_num >> k) << b) |
+                           (address & offset_mask);
+            if (fill[owner]->n == SHARD_CHUNK) {
+                shard_publish(&queue[owner]);
+                fill[owner] = NULL;
+            }
+        }
+    }
+    for (int i = 0; i < created; i++) {
+        if (fill != NULL && fill[i] != NULL)
+            shard_publish(&queue[i]);
+        atomic_store_explicit(&queue[i].done, 1, memory_order_release);
+    }
+
+    // merge the counters once every shard has drained its queue
+    memset(total, 0, sizeof(*total));
+    total->s = s;
+    total->E = E;
+    total->b = b;
+    total->S = 1 << s;
+    total->B = 1 << b;
+    total->t = ADDRESS_BITS - (s + b);
+    for (int i = 0; i < created; i++) {
+        pthread_join(shard[i].thread, NULL);
+        free_cache(&shard[i].cache);
+        total->hit += shard[i].cache.hit;
+        total->miss += shard[i].cache.miss;
+        total->eviction += shard[i].cache.eviction;
+        total->dirty_count += shard[i].cache.dirty_count;
+        total->dirty_eviction += shard[i].cache.dirty_eviction;
+        total->write_bytes += shard[i].cache.write_bytes;
+    }
+    free(fill);
+    free(queue);
+    free(shard);
+    return status;
+}
+
+/** @brief fill the summary of a simulated and freed cache. */
+void get_stats(const cache_t *cache, csim_stats_t *stats) {
+    stats->misses = cache->miss;
+    stats->hits = cache->hit;
+    stats->evictions = cache->eviction;
+    stats->dirty_evictions = cache->dirty_eviction * (unsigned long)cache->B;
+    stats->dirty_bytes = cache->dirty_count * (unsigned long)cache->B;
+}
+
+/** @brief print the prefetch counters of a cache: accuracy is the share
+ *         of prefetched lines used, coverage the share of would-be misses
+ *         a prefetch removed.
+ */
+void print_prefetch(const cache_t *cache) {
+    double useful = (double)cache->useful_prefetches;
+    double issued = (double)cache->prefetches;
+    double needed = useful + (double)cache->miss;
+    printf("prefetches:%lu useful:%lu accuracy:%.4f coverage:%.4f "
+           "pollution_misses:%lu\n",
+           cache->prefetches, cache->useful_prefetches,
+           issued > 0 ? useful / issued : 0, needed > 0 ? useful / needed : 0,
+           cache->pollution_misses);
+}
+
+/** @brief print the summary of a cache as one row prefixed by its
+ *         geometry, for the modes simulating several caches at once.
+ */
+void print_stats_row(const cache_t *cache) {
+    csim_stats_t stats;
+    get_stats(cache, &stats);
+    printf("s:%d E:%d b:%d hits:%lu misses:%lu evictions:%lu "
+           "dirty_bytes_in_cache:%lu dirty_bytes_evicted:%lu "
+           "bytes_written:%lu",
+           cache->s, cache->E, cache->b, stats.hits, stats.misses,
+           stats.evictions, stats.dirty_bytes, stats.dirty_evictions,
+           write_traffic(cache));
+    if (cache->prefetch != PREFETCH_NONE) {
+        printf(" ");
+        print_prefetch(cache);
+    } else {
+        printf("\n");
+    }
+}
+
+/** @brief read the geometries of a sweep, either from the file at spec or
+ *         from spec itself, as triples "s E b" separated by anything that
+ *         is not a digit ("2:4:6,3:8:6" or one triple per line). Text after
+ *         a '#' is ignored up to the end of the line.
+ *
+ *  @param[in]     spec      Path to a geometry file, or the list itself.
+ *  @param[out]    geometry  Allocated array of 3 * count integers.
+ *  @return number of geometries, or -1 if the list is malformed.
+ */
+int parse_geometries(const char *spec, int **geometry) {
+    char *text = NULL;
+    FILE *file = fopen(spec, "r");
+    if (file != NULL) {
+        size_t len = 0, cap = 256;
+        text = malloc(cap);
+        int c;
+        while (text != NULL && (c = fgetc(file)) != EOF) {
+            if (len + 2 > cap)
+                text = realloc(text, cap *= 2);
+            if (text != NULL)
+                text[len++] = (char)c;
+        }
+        fclose(file);
+        if (text == NULL)
+            return -1;
+        text[len] = '\0';
+    }
+
+    const char *p = text != NULL ? text : spec;
+    int count = 0, cap = 0;
+    int *values = NULL;
+    while (*p != '\0') {
+        if (*p == '#') {
+            while (*p != '\0' && *p != '\n')
+                p++;
+        } else if (*p >= '0' && *p <= '9') {
+            if (count == cap) {
+                cap = cap ? 2 * cap : 48;
+                int *grown = realloc(values, (size_t)cap * sizeof(int));
+                if (grown == NULL)
+                    break;
+                values = grown;
+            }
+            values[count++] = (int)strtol(p, (char **)&p, 10);
+        } else {
+            p++;
+        }
+    }
+    free(text);
+    if (count == 0 || count % 3 != 0 || *p != '\0') {
+        free(values);
+        return -1;
+    }
+    *geometry = values;
+    return count / 3;
+}
+
+/** State shared by the router and the workers of a sweep. Every worker
+ *  simulates the caches whose index is its own modulo the worker count,
+ *  on the batch published by the router between the two barriers.
+ */
+typedef struct {
+    cache_t *cache;
+    int caches;
+    int workers;
+    const trace_record_t *rec; /* batch being simulated */
+    size_t n;                  /* its length, 0 once the trace ended */
+    pthread_mutex_t gate;      /* held until every worker was started */
+    pthread_barrier_t start;   /* a batch has been published */
+    pthread_barrier_t finish;  /* every worker is done with the batch */
+} sweep_t;
+
+typedef struct {
+    sweep_t *sweep;
+    int index;
+    pthread_t thread;
+} sweep_worker_t;
+
+/** @brief simulate every published batch on the caches of one worker. */
+static void *run_sweep_worker(void *arg) {
+    sweep_worker_t *worker = arg;
+    sweep_t *sweep = worker->sweep;
+    // the barriers only exist once the router knows how many workers run
+    pthread_mutex_lock(&sweep->gate);
+    pthread_mutex_unlock(&sweep->gate);
+    for (;;) {
+        pthread_barrier_wait(&sweep->start);
+        if (sweep->n == 0)
+            break;
+        for (int i = worker->index; i < sweep->caches; i += sweep->workers)
+            sweep->cache[i].kernel(&sweep->cache[i], sweep->rec, sweep->n);
+        pthread_barrier_wait(&sweep->finish);
+    }
+    return NULL;
+}
+
+/** @brief simulate several caches in a single pass over the trace. The
+ *         router decodes the next batch into a second buffer while the
+ *         workers simulate the current one. If no worker thread can be
+ *         started, the caches are simulated on the calling thread.
+ *
+ *  @param[in]     reader    Opened trace, read until its end.
+ *  @param[in,out] cache     Initialized caches, freed on return.
+ *  @param[in]     caches    Number of caches.
+ *  @param[in]     jobs      Number of worker threads.
+ *  @return 0 on success, -1 if the memory could not be allocated.
+ */
+int simulate_sweep(trace_reader_t *reader, cache_t *cache, int caches,
+                   int jobs) {
+    sweep_t sweep;
+    sweep.cache = cache;
+    sweep.caches = caches;
+    int wanted = jobs < 1 ? 1 : (jobs > caches ? caches : jobs);
+    sweep_worker_t *worker = calloc((size_t)wanted, sizeof(*worker));
+    trace_record_t *buffer = malloc(2 * RECORD_BATCH * sizeof(*buffer));
+    if (worker == NULL || buffer == NULL) {
+        free(worker);
+        free(buffer);
+        return -1;
+    }
+    pthread_mutex_init(&sweep.gate, NULL);
+    pthread_mutex_lock(&sweep.gate);
+    int started = 0;
+    for (; started < wanted; started++) {
+        worker[started].sweep = &sweep;
+        worker[started].index = started;
+        if (pthread_create(&worker[started].thread, NULL, run_sweep_worker,
+                           &worker[started]) != 0)
+            break;
+    }
+    sweep.workers = started;
+    pthread_barrier_init(&sweep.start, NULL, (unsigned)started + 1);
+    pthread_barrier_init(&sweep.finish, NULL, (unsigned)started + 1);
+    pthread_mutex_unlock(&sweep.gate);
+
+    const trace_record_t *batch;
+    size_t n = read_batch(reader, &batch);
+    int cur = 0;
+    while (n > 0) {
+        if (started == 0) {
+            for (int i = 0; i < caches; i++)
+                cache[i].kernel(&cache[i], batch, n);
+            n = read_batch(reader, &batch);
+            continue;
+        }
+        // batches in the mapping stay valid, the reader's own are reused
+        if (batch == reader->batch) {
+            memcpy(buffer + cur * RECORD_BATCH, batch, n * sizeof(*batch));
+            batch = buffer + cur * RECORD_BATCH;
+        }
+        sweep.rec = batch;
+        sweep.n = n;
+        pthread_barrier_wait(&sweep.start);
+        n = read_batch(reader, &batch);
+        pthread_barrier_wait(&sweep.finish);
+        cur ^= 1;
+    }
+    sweep.n = 0;
+    pthread_barrier_wait(&sweep.start);
+    for (int i = 0; i < started; i++)
+        pthread_join(worker[i].thread, NULL);
+    for (int i = 0; i < caches; i++)
+        free_cache(&cache[i]);
+
+    pthread_barrier_destroy(&sweep.start);
+    pthread_barrier_destroy(&sweep.finish);
+    pthread_mutex_destroy(&sweep.gate);
+    free(buffer);
+    free(worker);
+    return 0;
+}
+
+/** How the levels of a hierarchy share blocks, selected with -I
+ *  INCLUSION_NINE        non-inclusive non-exclusive: a miss fills every
+ *                        level it goes through, and each level evicts on
+ *                        its own
+ *  INCLUSION_INCLUSIVE   as NINE, and a block evicted from a level is
+ *                        back-invalidated in every level above
+ *  INCLUSION_EXCLUSIVE   a block lives in one level at most: a miss fills
+ *                        the first level only, the victims of a level fill
+ *                        the next one, and a hit below moves the block up
+ */
+typedef enum {
+    INCLUSION_NINE,
+    INCLUSION_INCLUSIVE,
+    INCLUSION_EXCLUSIVE
+} inclusion_t;
+
+/** Cache levels from L1 down. Misses of a level are reads of the next
+ *  one and its dirty evictions are writebacks (stores) to it; what leaves
+ *  the last level goes to memory.
+ */
+typedef struct {
+    cache_t *level;
+    int levels;
+    inclusion_t inclusion;
+} hierarchy_t;
+
+/** @brief access a block of a level under its write policy.
+ *
+ *  @return as count_write(); a miss leaves the level's victim, if any, in
+ *          cache->evicted, victim_dirty and victim_block.
+ */
+static int level_access(cache_t *cache, unsigned long block, int store,
+                        uint32_t size) {
+    return count_write(cache, block >> cache->s,
+                       block & (unsigned long)(cache->S - 1), store, size);
+}
+
+/** @brief put a block into a level without counting a demand access, as
+ *         when an exclusive level above hands down its victim.
+ */
+static void level_fill(cache_t *cache, unsigned long block, int dirty) {
+    unsigned long hit = cache->hit, miss = cache->miss;
+    level_access(cache, block, dirty, (uint32_t)cache->B);
+    cache->hit = hit;
+    cache->miss = miss;
+}
+
+/** @brief remove a block from a level. LRU moves the way to its LRU end
+ *         so it is reused first, the other policies count it as a hole.
+ *
+ *  @return the flags the line had, 0 if the block was not cached.
+ */
+static int level_invalidate(cache_t *cache, unsigned long block) {
+    unsigned long set_num = block & (unsigned long)(cache->S - 1);
+    unsigned long tag = block >> cache->s;
+    if (cache->engine == ENGINE_DIRECT) {
+        unsigned long word = set_num / 64;
+        uint64_t bit = (uint64_t)1 << (set_num % 64);
+        if (cache->line_tag[set_num] != tag ||
+            !(cache->line_valid[word] & bit))
+            return 0;
+        int flags = LINE_VALID | (cache->line_dirty[word] & bit ? LINE_DIRTY
+                                                                 : 0);
+        cache->line_valid[word] &= ~bit;
+        cache->line_dirty[word] &= ~bit;
+        return flags;
+    }
+    queue_set_t *set = &cache->sets[set_num];
+    int way = match_tag(set->tag, set->flags, set->curr_line_num, tag);
+    if (way < 0)
+        return 0;
+    int flags = set->flags[way];
+    if (cache->policy == POLICY_LRU) {
+        if (cache->engine == ENGINE_HASH)
+            hash_remove(cache, hash_find(cache, tag, set_num));
+        list_move_to_tail(set, way);
+    } else {
+        set->holes += 1;
+    }
+    set->flags[way] = 0;
+    return flags;
+}
+
+/** @brief mark a block cached by a level as modified. */
+static void level_mark_dirty(cache_t *cache, unsigned long block) {
+    unsigned long set_num = block & (unsigned long)(cache->S - 1);
+    if (cache->engine == ENGINE_DIRECT) {
+        cache->line_dirty[set_num / 64] |= (uint64_t)1 << (set_num % 64);
+        return;
+    }
+    queue_set_t *set = &cache->sets[set_num];
+    int way = match_tag(set->tag, set->flags, set->curr_line_num,
+                        block >> cache->s);
+    if (way >= 0)
+        set->flags[way] |= LINE_DIRTY;
+}
+
+/** @brief remove every block covered by a block evicted from level j
+ *         from the levels above it. Every copy removed counts as an
+ *         eviction of its level, and a dirty one leaves with the victim.
+ *
+ *  @return whether a copy above was dirty, so that the victim must be
+ *          written back even if level j held it clean.
+ */
+static int back_invalidate(hierarchy_t *h, int j, unsigned long block) {
+    cache_t *below = &h->level[j];
+    int dirty = 0;
+    for (int i = 0; i < j; i++) {
+        cache_t *cache = &h->level[i];
+        int shift = below->b - cache->b;
+        unsigned long first = block << shift;
+        for (unsigned long k = 0; k < 1UL << shift; k++) {
+            int flags = level_invalidate(cache, first + k);
+            if (flags == 0)
+                continue;
+            cache->eviction += 1;
+            if (flags & LINE_DIRTY) {
+                cache->dirty_eviction += 1;
+                dirty = 1;
+            }
+        }
+    }
+    return dirty;
+}
+
+/** @brief access an address at level i of a NINE or inclusive hierarchy;
+ *         a miss writes back the level's dirty victim, then reads the
+ *         block from the next level. A store that is written through or
+ *         bypasses the level goes to the next level last.
+ */
+static void hierarchy_access(hierarchy_t *h, int i, uint64_t address,
+                             int store, uint32_t size) {
+    if (i == h->levels)
+        return;
+    cache_t *cache = &h->level[i];
+    int hit = level_access(cache, address >> cache->b, store, size);
+    if (hit == 0) {
+        if (cache->evicted) {
+            unsigned long victim = cache->victim_block;
+            int victim_dirty = cache->victim_dirty;
+            if (h->inclusion == INCLUSION_INCLUSIVE)
+                victim_dirty |= back_invalidate(h, i, victim);
+            if (victim_dirty)
+                hierarchy_access(h, i + 1, (uint64_t)victim << cache->b, 1,
+                                 (uint32_t)cache->B);
+        }
+        hierarchy_access(h, i + 1, address, 0, (uint32_t)cache->B);
+    }
+    if (store && (hit < 0 || (cache->write & WRITE_THROUGH)))
+        hierarchy_access(h, i + 1, address, 1, size);
+}
+
+/** @brief access an address of an exclusive hierarchy. */
+static void exclusive_access(hierarchy_t *h, uint64_t address, int dirty) {
+    cache_t *top = &h->level[0];
+    unsigned long block = address >> top->b;
+    if (level_access(top, block, dirty, (uint32_t)top->B))
+        return;
+    int evicted = top->evicted;
+    int victim_dirty = top->victim_dirty;
+    unsigned long victim = top->victim_block;
+
+    // the first level below holding the block hands it up
+    for (int i = 1; i < h->levels; i++) {
+        cache_t *cache = &h->level[i];
+        int flags = level_invalidate(cache, block);
+        if (flags != 0) {
+            cache->hit += 1;
+            if (flags & LINE_DIRTY)
+                level_mark_dirty(top, block);
+            break;
+        }
+        cache->miss += 1;
+    }
+    // victims go one level down, the last level's to memory
+    for (int i = 1; evicted && i < h->levels; i++) {
+        cache_t *cache = &h->level[i];
+        level_fill(cache, victim, victim_dirty);
+        evicted = cache->evicted;
+        victim_dirty = cache->victim_dirty;
+        victim = cache->victim_block;
+    }
+}
+
+/** @brief simulate a batch of accesses on a hierarchy, serially. */
+static void hierarchy_batch(hierarchy_t *h, const trace_record_t *rec,
+                            size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (rec[i].op != 'L' && rec[i].op != 'S')
+            continue;
+        if (h->inclusion == INCLUSION_EXCLUSIVE)
+            exclusive_access(h, rec[i].address, rec[i].op == 'S');
+        else
+            hierarchy_access(h, 0, rec[i].address, rec[i].op == 'S',
+                             rec[i].size);
+    }
+}
+
+/** @brief create the levels of a hierarchy. LRU levels use the list (or
+ *         hash, or direct-mapped) engine, which can drop a line; ARC,
+ *         LIRS, OPT and prefetchers cannot run in a level. Block sizes
+ *         may only grow down the hierarchy, and stay equal when it is
+ *         exclusive, which only writes back and allocates.
+ *
+ *  @param[out]    h          Hierarchy to initialize.
+ *  @param[in]     geometry   s, E and b of every level, from L1 down.
+ *  @param[in]     levels     Number of levels.
+ *  @param[in]     options    Engine and policy of every level.
+ *  @param[in]     inclusion  How the levels share blocks.
+ *  @return 0 on success, -1 if a level could not be created.
+ */
+int init_hierarchy(hierarchy_t *h, const int *geometry, int levels,
+                   const cache_options_t *options, inclusion_t inclusion) {
+    h->levels = levels;
+    h->inclusion = inclusion;
+    h->level = calloc((size_t)levels, sizeof(cache_t));
+    if (h->level == NULL || options->engine == ENGINE_AGE ||
+        (inclusion == INCLUSION_EXCLUSIVE && options->write != 0) ||
+        options->prefetch != PREFETCH_NONE ||
+        options->engine == ENGINE_MATRIX || options->policy == POLICY_ARC ||
+        options->policy == POLICY_LIRS || options->policy == POLICY_OPT)
+        return -1;
+    for (int i = 0; i < levels; i++) {
+        int s = geometry[3 * i], E = geometry[3 * i + 1];
+        int b = geometry[3 * i + 2];
+        if (i > 0 && (b < geometry[3 * i - 1] ||
+                      (inclusion == INCLUSION_EXCLUSIVE &&
+                       b != geometry[3 * i - 1])))
+            return -1;
+        cache_options_t level = *options;
+        if (level.engine == ENGINE_AUTO && level.policy == POLICY_LRU)
+            level.engine = E == 1 ? ENGINE_DIRECT
+                                  : (E > HASH_MIN_WAYS ? ENGINE_HASH
+                                                       : ENGINE_LIST);
+        if (init_cache(&h->level[i], s, E, b, &level) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/** A level of a NINE hierarchy simulated on its own thread, reading the
+ *  misses and writebacks of the level above from a queue.
+ */
+typedef struct {
+    cache_t *cache;
+    shard_queue_t *in;
+    shard_queue_t *out; /* next level, NULL for the last one */
+    shard_chunk_t *fill; /* chunk of out being filled */
+    pthread_t thread;
+} stage_t;
+
+/** @brief append a record to the chunk being filled for the next stage. */
+static void stage_emit(stage_t *stage, uint64_t address, uint32_t size,
+                       int op) {
+    if (stage->out == NULL)
+        return;
+    if (stage->fill == NULL) {
+        stage->fill = shard_reserve(stage->out);
+        stage->fill->n = 0;
+    }
+    trace_record_t *rec = &stage->fill->rec[stage->fill->n++];
+    rec->address = address;
+    rec->size = size;
+    rec->op = (uint8_t)op;
+    if (stage->fill->n == SHARD_CHUNK) {
+        shard_publish(stage->out);
+        stage->fill = NULL;
+    }
+}
+
+/** @brief simulate records on the level of a stage, passing its
+ *         writebacks and misses on in the order a serial run makes them.
+ */
+static void stage_batch(stage_t *stage, const trace_record_t *rec,
+                        size_t n) {
+    cache_t *cache = stage->cache;
+    for (size_t i = 0; i < n; i++) {
+        if (rec[i].op != 'L' && rec[i].op != 'S')
+            continue;
+        uint64_t address = rec[i].address;
+        uint32_t B = (uint32_t)cache->B;
+        int store = rec[i].op == 'S';
+        int hit = level_access(cache, address >> cache->b, store,
+                               rec[i].size);
+        if (hit == 0) {
+            if (cache->evicted && cache->victim_dirty)
+                stage_emit(stage,
+                           (uint64_t)cache->victim_block << cache->b, B,
+                           'S');
+            stage_emit(stage, address, B, 'L');
+        }
+        if (store && (hit < 0 || (cache->write & WRITE_THROUGH)))
+            stage_emit(stage, address, rec[i].size, 'S');
+    }
+}
+
+/** @brief hand the last chunk of a stage to the next one and end it. */
+static void stage_close(stage_t *stage) {
+    if (stage->out == NULL)
+        return;
+    if (stage->fill != NULL)
+        shard_publish(stage->out);
+    stage->fill = NULL;
+    atomic_store_explicit(&stage->out->done, 1, memory_order_release);
+}
+
+/** @brief simulate every chunk published to a stage until the stage above
+ *         is done.
+ */
+static void *run_stage(void *arg) {
+    stage_t *stage = arg;
+    shard_queue_t *queue = stage->in;
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    for (;;) {
+        if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+            if (atomic_load_explicit(&queue->done, memory_order_acquire) &&
+                head == atomic_load_explicit(&queue->tail,
+                                             memory_order_acquire))
+                break;
+            sched_yield();
+            continue;
+        }
+        shard_chunk_t *chunk = &queue->chunk[head % SHARD_QUEUE];
+        stage_batch(stage, chunk->rec, chunk->n);
+        head += 1;
+        atomic_store_explicit(&queue->head, head, memory_order_release);
+    }
+    stage_close(stage);
+    return NULL;
+}
+
+/** @brief simulate the trace on a hierarchy. With jobs > 1 a NINE
+ *         hierarchy runs as a pipeline: the calling thread simulates L1
+ *         and every level below gets a thread fed through a queue. No
+ *         level reports back to the one above, so the counters match a
+ *         serial run exactly. Inclusive and exclusive hierarchies, and a
+ *         pipeline whose threads cannot all be started, run serially.
+ *
+ *  @param[in]     reader    Opened trace, read until its end.
+ *  @param[in,out] h         Initialized hierarchy, its levels freed on
+ *                           return.
+ *  @param[in]     jobs      Number of threads requested.
+ *  @return 0 on success, -1 if the memory could not be allocated.
+ */
+int simulate_hierarchy(trace_reader_t *reader, hierarchy_t *h, int jobs) {
+    int levels = h->levels;
+    int pipelined = jobs > 1 && levels > 1 && h->inclusion == INCLUSION_NINE;
+    stage_t *stage = calloc((size_t)levels, sizeof(*stage));
+    size_t size = (size_t)levels * sizeof(shard_queue_t);
+    shard_queue_t *queue = aligned_alloc(64, (size + 63) & ~(size_t)63);
+    if (stage == NULL || queue == NULL) {
+        free(stage);
+        free(queue);
+        return -1;
+    }
+    int started = 1;
+    for (int i = 0; pipelined && i < levels; i++) {
+        atomic_init(&queue[i].head, 0);
+        atomic_init(&queue[i].tail, 0);
+        atomic_init(&queue[i].done, 0);
+        stage[i].cache = &h->level[i];
+        stage[i].in = &queue[i];
+        stage[i].out = i + 1 < levels ? &queue[i + 1] : NULL;
+    }
+    for (; pipelined && started < levels; started++) {
+        if (pthread_create(&stage[started].thread, NULL, run_stage,
+                           &stage[started]) != 0)
+            break;
+    }
+    if (pipelined && started < levels) {
+        // stop the stages that run before any record reaches them
+        for (int i = 1; i < started; i++)
+            atomic_store_explicit(&queue[i].done, 1, memory_order_release);
+        for (int i = 1; i < started; i++)
+            pthread_join(stage[i].thread, NULL);
+        pipelined = 0;
+        started = 1;
+    }
+
+    const trace_record_t *batch;
+    size_t n;
+    while ((n = read_batch(reader, &batch)) > 0) {
+        if (pipelined)
+            stage_batch(&stage[0], batch, n);
+        else
+            hierarchy_batch(h, batch, n);
+    }
+    if (pipelined) {
+        stage_close(&stage[0]);
+        for (int i = 1; i < levels; i++)
+            pthread_join(stage[i].thread, NULL);
+    }
+    for (int i = 0; i < levels; i++)
+        free_cache(&h->level[i]);
+    free(stage);
+    free(queue);
+    return 0;
+}
+
+/* Floor of a stack entry that is clean in every associativity */
+#define FLOOR_CLEAN 0xffffffffu
+
+/** Mattson stack-distance simulation of every LRU associativity from 1 to
+ *  Emax at once. Each set keeps its Emax most recently used blocks in
+ *  recency order; by the inclusion property, an access at depth d hits in
+ *  every cache with E > d, and an entry pushed from depth p to p + 1 is an
+ *  eviction in the cache with E = p + 1.
+ *
+ *  For dirty evictions every entry keeps a floor: the line is dirty in the
+ *  cache of associativity E iff E >= floor. A store sets the floor to 1; a
+ *  load at depth d reinserts a clean line in the caches with E <= d, so it
+ *  raises the floor to d + 1.
+ */
+typedef struct {
+    int s, Emax, b;
+    unsigned long *tag;           /* Emax tags per set, MRU first */
+    unsigned int *floor;          /* dirty floor of each entry */
+    int *depth;                   /* number of entries of each set */
+    unsigned char *valid;         /* Emax LINE_VALID bytes for match_tag */
+    unsigned long accesses;       /* loads and stores simulated */
+    unsigned long *hits_at;       /* accesses found at each depth */
+    unsigned long *evict_diff;    /* evictions per E, as differences */
+    unsigned long *dirty_evict_at; /* dirty evictions per E - 1 */
+} stack_sim_t;
+
+/** @brief allocate the stacks of every set, all of them empty.
+ *
+ *  @return 0 on success, -1 if the memory could not be allocated.
+ */
+int init_stack_sim(stack_sim_t *sim, int s, int Emax, int b) {
+    memset(sim, 0, sizeof(*sim));
+    sim->s = s;
+    sim->Emax = Emax;
+    sim->b = b;
+    size_t entries = ((size_t)1 << s) * (size_t)Emax;
+    sim->tag = malloc(entries * sizeof(unsigned long));
+    sim->floor = malloc(entries * sizeof(unsigned int));
+    sim->depth = calloc((size_t)1 << s, sizeof(int));
+    sim->valid = malloc((size_t)Emax);
+    sim->hits_at = calloc((size_t)Emax, sizeof(unsigned long));
+    sim->evict_diff = calloc((size_t)Emax + 1, sizeof(unsigned long));
+    sim->dirty_evict_at = calloc((size_t)Emax, sizeof(unsigned long));
+    if (Emax < 1 || sim->tag == NULL || sim->floor == NULL ||
+        sim->depth == NULL || sim->valid == NULL || sim->hits_at == NULL ||
+        sim->evict_diff == NULL || sim->dirty_evict_at == NULL)
+        return -1;
+    memset(sim->valid, LINE_VALID, (size_t)Emax);
+    return 0;
+}
+
+/** @brief move a block to the top of its set's stack, accounting for the
+ *         hits and evictions it causes in every associativity.
+ */
+static void stack_access(stack_sim_t *sim, unsigned long curr_tag,
+                         unsigned long curr_set_num, int dirty) {
+    size_t base = curr_set_num * (size_t)sim->Emax;
+    unsigned long *tag = sim->tag + base;
+    unsigned int *floor = sim->floor + base;
+    int n = sim->depth[curr_set_num];
+    int d = match_tag(tag, sim->valid, n, curr_tag);
+    unsigned int new_floor = dirty ? 1 : FLOOR_CLEAN;
+    sim->accesses += 1;
+
+    // every entry above the block moves one deeper: the one leaving depth
+    // p is evicted from the cache with E = p + 1
+    int shifted;
+    if (d >= 0) {
+        sim->hits_at[d] += 1;
+        if (!dirty && floor[d] != FLOOR_CLEAN)
+            new_floor = floor[d] > (unsigned int)d + 1 ? floor[d]
+                                                       : (unsigned int)d + 1;
+        shifted = d;
+    } else {
+        shifted = n;
+        if (n < sim->Emax)
+            sim->depth[curr_set_num] = n + 1;
+    }
+    int evicted = shifted < sim->Emax ? shifted : sim->Emax;
+    sim->evict_diff[0] += 1;
+    sim->evict_diff[evicted] -= 1;
+    for (int p = 0; p < evicted; p++) {
+        if (floor[p] <= (unsigned int)p + 1)
+            sim->dirty_evict_at[p] += 1;
+    }
+    int moved = shifted < sim->Emax ? shifted : sim->Emax - 1;
+    memmove(tag + 1, tag, (size_t)moved * sizeof(*tag));
+    memmove(floor + 1, floor, (size_t)moved * sizeof(*floor));
+    tag[0] = curr_tag;
+    floor[0] = new_floor;
+}
+
+/** @brief simulate a batch of records on every associativity. */
+void stack_batch(stack_sim_t *sim, const trace_record_t *rec, size_t n) {
+    int s = sim->s, b = sim->b;
+    unsigned long set_mask = (1UL << s) - 1;
+    for (size_t i = 0; i < n; i++) {
+        if (rec[i].op != 'L' && rec[i].op != 'S')
+            continue;
+        unsigned long address = rec[i].address;
+        stack_access(sim, address >> (s + b), (address >> b) & set_mask,
+                     rec[i].op == 'S');
+    }
+}
+
+/** @brief derive the counters of the cache with associativity E.
+ *
+ *  @param[in]     sim       Stack simulation after the whole trace.
+ *  @param[in]     E         Associativity, from 1 to Emax.
+ *  @param[out]    cache     Geometry and counters of that cache.
+ */
+void stack_counters(const stack_sim_t *sim, int E, cache_t *cache) {
+    memset(cache, 0, sizeof(*cache));
+    cache->s = sim->s;
+    cache->E = E;
+    cache->b = sim->b;
+    cache->S = 1 << sim->s;
+    cache->B = 1 << sim->b;
+    cache->t = ADDRESS_BITS - (sim->s + sim->b);
+    unsigned long evictions = 0;
+    for (int d = 0; d < E; d++) {
+        cache->hit += sim->hits_at[d];
+        evictions += sim->evict_diff[d];
+    }
+    cache->miss = sim->accesses - cache->hit;
+    cache->eviction = evictions;
+    cache->dirty_eviction = sim->dirty_evict_at[E - 1];
+    // lines left in the cache are the entries above depth E
+    for (size_t i = 0; i < (size_t)cache->S; i++) {
+        const unsigned int *floor = sim->floor + i * (size_t)sim->Emax;
+        int n = sim->depth[i] < E ? sim->depth[i] : E;
+        for (int p = 0; p < n; p++) {
+            if (floor[p] <= (unsigned int)E)
+                cache->dirty_count += 1;
+        }
+    }
+}
+
+void free_stack_sim(stack_sim_t *sim) {
+    free(sim->tag);
+    free(sim->floor);
+    free(sim->depth);
+    free(sim->valid);
+    free(sim->hits_at);
+    free(sim->evict_diff);
+    free(sim->dirty_evict_at);
+}
+
+/** Open-addressing hash map from a 64-bit key to a nonzero 64-bit value,
+ *  with linear probing. An empty slot holds the value 0, so callers must
+ *  store nonzero values. The table doubles when it gets half full.
+ */
+typedef struct {
+    uint64_t *key;
+    uint64_t *value;
+    size_t mask;  /* number of slots - 1 */
+    size_t count; /* number of keys stored */
+} block_map_t;
+
+/** @brief allocate an empty map of at least the given number of slots.
+ *
+ *  @return 0 on success, -1 if the memory could not be allocated.
+ */
+int map_init(block_map_t *map, size_t slots) {
+    size_t n = 16;
+    while (n < slots)
+        n *= 2;
+    map->key = malloc(n * sizeof(uint64_t));
+    map->value = calloc(n, sizeof(uint64_t));
+    map->mask = n - 1;
+    map->count = 0;
+    return map->key == NULL || map->value == NULL ? -1 : 0;
+}
+
+void map_free(block_map_t *map) {
+    free(map->key);
+    free(map->value);
+    map->key = NULL;
+    map->value = NULL;
+}
+
+/** @brief return the slot holding key, or the empty slot where it would go */
+static inline size_t map_slot(const block_map_t *map, uint64_t key) {
+    size_t i = (size_t)hash64(key) & map->mask;
+    while (map->value[i] != 0 && map->key[i] != key)
+        i = (i + 1) & map->mask;
+    return i;
+}
+
+/** @brief return the value of key, or NULL if it is not in the map. */
+static inline uint64_t *map_find(block_map_t *map, uint64_t key) {
+    size_t i = map_slot(map, key);
+    return map->value[i] != 0 ? &map->value[i] : NULL;
+}
+
+/** @brief double the number of slots and reinsert every key. */
+static int map_grow(block_map_t *map) {
+    block_map_t old = *map;
+    if (map_init(map, 2 * (old.mask + 1)) != 0) {
+        map_free(map);
+        *map = old;
+        return -1;
+    }
+    for (size_t i = 0; i <= old.mask; i++) {
+        if (old.value[i] != 0) {
+            size_t j = map_slot(map, old.key[i]);
+            map->key[j] = old.key[i];
+            map->value[j] = old.value[i];
+        }
+    }
+    map->count = old.count;
+    map_free(&old);
+    return 0;
+}
+
+/** @brief return the value of key, adding the key with the value 0 if it
+ *         is not in the map; the caller then stores a nonzero value. The
+ *         pointer is valid until the next insertion.
+ *
+ *  @return pointer to the value, NULL if the map could not grow.
+ */
+static inline uint64_t *map_insert(block_map_t *map, uint64_t key) {
+    if (2 * (map->count + 1) > map->mask + 1 && map_grow(map) != 0)
+        return NULL;
+    size_t i = map_slot(map, key);
+    if (map->value[i] == 0) {
+        map->key[i] = key;
+        map->count += 1;
+    }
+    return &map->value[i];
+}
+
+/** @brief remove key from the map, shifting back later entries of its
+ *         probe run so that no tombstones are needed.
+ */
+static void map_erase(block_map_t *map, uint64_t key) {
+    size_t i = map_slot(map, key);
+    if (map->value[i] == 0)
+        return;
+    map->count -= 1;
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & map->mask;
+        if (map->value[j] == 0)
+            break;
+        size_t home = (size_t)hash64(map->key[j]) & map->mask;
+        // move the entry back unless its home lies cyclically in (i, j]
+        if (((j - home) & map->mask) >= ((j - i) & map->mask)) {
+            map->key[i] = map->key[j];
+            map->value[i] = map->value[j];
+            i = j;
+        }
+    }
+    map->value[i] = 0;
+}
+
+/* Largest number of cores of a coherent simulation, one directory bit each */
+#define MAX_CORES 32
+
+/** Coherence protocol of the private caches, selected with -C. A line is
+ *  in state M with LINE_VALID | LINE_DIRTY | LINE_EXCLUSIVE, E with
+ *  LINE_VALID | LINE_EXCLUSIVE, S with LINE_VALID and, under MOESI, O with
+ *  LINE_VALID | LINE_DIRTY.
+ *  PROTOCOL_MESI    a modified line read by another core is written back
+ *                   and both copies are shared
+ *  PROTOCOL_MOESI   the modified copy becomes the owner and keeps
+ *                   supplying the line, written back when it is evicted
+ */
+typedef enum { PROTOCOL_MESI, PROTOCOL_MOESI } protocol_t;
+
+/** Coherence counters of a core */
+typedef struct {
+    unsigned long invalidations;    /* lines taken by a write of another */
+    unsigned long coherence_misses; /* misses on a line taken that way */
+    unsigned long upgrades;         /* stores to a shared or owned line */
+    unsigned long transfers;  /* misses served by the dirty copy of another */
+    unsigned long writebacks; /* modified lines written back for a reader */
+} coherence_stats_t;
+
+/* Bits of a directory entry: the cores holding the block, and above them
+ * the cores whose copy was invalidated since they last held it */
+#define DIRECTORY_SHARERS 0xffffffffULL
+#define DIRECTORY_LOST_SHIFT 32
+
+/** Private caches of every core, kept coherent by a directory, over the
+ *  levels they share. A core gets its cache when it first shows up in the
+ *  trace.
+ */
+typedef struct {
+    cache_t cache[MAX_CORES];
+    coherence_stats_t stats[MAX_CORES];
+    uint32_t present; /* cores that have a cache */
+    block_map_t directory; /* block -> DIRECTORY_SHARERS and lost bits */
+    hierarchy_t *shared;   /* levels below the private caches, or NULL */
+    protocol_t protocol;
+    int s, E, b;
+    cache_options_t options; /* of the private caches */
+} coherent_t;
+
+/** @brief return the flags of a block held by a private cache, or NULL. */
+static unsigned char *block_flags(cache_t *cache, unsigned long block) {
+    return line_flags(cache, block >> cache->s,
+                      block & (unsigned long)(cache->S - 1));
+}
+
+/** @brief create the private caches of up to MAX_CORES cores. They use
+ *         the list or hash engine, which can drop a line, write back and
+ *         allocate, and do not prefetch.
+ *
+ *  @param[out]    sys       Coherent caches to initialize.
+ *  @param[in]     s, E, b   Geometry of every private cache.
+ *  @param[in]     options   Engine and policy of the private caches.
+ *  @param[in]     shared    Initialized levels below, or NULL for memory.
+ *  @param[in]     protocol  Coherence protocol.
+ *  @return 0 on success, -1 if the options do not allow coherence or the
+ *          memory could not be allocated.
+ */
+int init_coherent(coherent_t *sys, int s, int E, int b,
+                  const cache_options_t *options, hierarchy_t *shared,
+                  protocol_t protocol) {
+    memset(sys, 0, sizeof(*sys));
+    sys->s = s;
+    sys->E = E;
+    sys->b = b;
+    sys->options = *options;
+    sys->shared = shared;
+    sys->protocol = protocol;
+    // a direct-mapped cache keeps no flags byte, it gets a one-way list
+    if (E == 1)
+        sys->options.policy = POLICY_LRU;
+    lru_engine_t engine = sys->options.engine;
+    if (sys->options.policy == POLICY_LRU && engine == ENGINE_AUTO)
+        sys->options.engine = E > HASH_MIN_WAYS ? ENGINE_HASH : ENGINE_LIST;
+    if ((sys->options.policy == POLICY_LRU && engine != ENGINE_AUTO &&
+         engine != ENGINE_LIST && engine != ENGINE_HASH) ||
+        options->policy == POLICY_ARC || options->policy == POLICY_LIRS ||
+        options->policy == POLICY_OPT || options->write != 0 ||
+        options->prefetch != PREFETCH_NONE ||
+        (shared != NULL && (shared->inclusion != INCLUSION_NINE ||
+                            shared->level[0].b < b)))
+        return -1;
+    return map_init(&sys->directory, 1024);
+}
+
+/** @brief read or write a block in the levels below the private caches. */
+static void shared_access(coherent_t *sys, uint64_t address, int store,
+                          uint32_t size) {
+    if (sys->shared != NULL)
+        hierarchy_access(sys->shared, 0, address, store, size);
+}
+
+/** @brief simulate one access of a core. A store to a line other cores
+ *         hold invalidates their copies, as an upgrade if the core has a
+ *         shared copy; a read miss takes the line from a dirty copy, or
+ *         else from the shared levels, and demotes every other copy.
+ *
+ *  @return 0 on success, -1 if the memory could not be allocated.
+ */
+static int coherent_access(coherent_t *sys, int core, uint64_t address,
+                           int store, uint32_t size) {
+    uint32_t bit = (uint32_t)1 << core;
+    cache_t *cache = &sys->cache[core];
+    if (!(sys->present & bit)) {
+        if (init_cache(cache, sys->s, sys->E, sys->b, &sys->options) != 0)
+            return -1;
+        sys->present |= bit;
+    }
+    coherence_stats_t *stats = &sys->stats[core];
+    unsigned long block = address >> sys->b;
+    uint32_t B = (uint32_t)cache->B;
+    uint64_t *entry = map_insert(&sys->directory, block);
+    if (entry == NULL)
+        return -1;
+    uint32_t others = (uint32_t)(*entry & DIRECTORY_SHARERS) & ~bit;
+    unsigned char *flags = block_flags(cache, block);
+    if (flags != NULL && (!store || (*flags & LINE_EXCLUSIVE))) {
+        level_access(cache, block, store, size);
+        return 0;
+    }
+    if (flags != NULL) {
+        stats->upgrades += 1;
+    } else if (*entry & ((uint64_t)bit << DIRECTORY_LOST_SHIFT)) {
+        stats->coherence_misses += 1;
+        *entry &= ~((uint64_t)bit << DIRECTORY_LOST_SHIFT);
+    }
+
+    int supplied = 0;
+    for (uint32_t left = others; left != 0; left &= left - 1) {
+        int peer = __builtin_ctz(left);
+        cache_t *other = &sys->cache[peer];
+        unsigned char *peer_flags = block_flags(other, block);
+        supplied |= (*peer_flags & LINE_DIRTY) != 0;
+        if (store) {
+            // the data or the ownership moves with the invalidation
+            level_invalidate(other, block);
+            sys->stats[peer].invalidations += 1;
+            *entry &= ~(uint64_t)(1u << peer);
+            *entry |= (uint64_t)(1u << peer) << DIRECTORY_LOST_SHIFT;
+        } else if ((*peer_flags & LINE_DIRTY) &&
+                   sys->protocol == PROTOCOL_MESI) {
+            sys->stats[peer].writebacks += 1;
+            shared_access(sys, (uint64_t)block << sys->b, 1, B);
+            *peer_flags = LINE_VALID;
+        } else {
+            *peer_flags &= (unsigned char)~LINE_EXCLUSIVE;
+        }
+    }
+    if (flags != NULL) {
+        level_access(cache, block, store, size);
+        *flags |= LINE_EXCLUSIVE;
+        return 0;
+    }
+
+    level_access(cache, block, store, size);
+    flags = block_flags(cache, block);
+    if (store)
+        *flags = LINE_VALID | LINE_DIRTY | LINE_EXCLUSIVE;
+    else
+        *flags = others != 0 ? LINE_VALID : LINE_VALID | LINE_EXCLUSIVE;
+    *entry |= bit;
+    int evicted = cache->evicted;
+    if (supplied)
+        stats->transfers += 1;
+    if (evicted) {
+        unsigned long victim = cache->victim_block;
+        if (cache->victim_dirty)
+            shared_access(sys, (uint64_t)victim << sys->b, 1, B);
+        uint64_t *held = map_find(&sys->directory, victim);
+        uint64_t left = *held & ~(uint64_t)bit;
+        // a zero value reads as an empty slot, so erase before clearing
+        if (left == 0)
+            map_erase(&sys->directory, victim);
+        else
+            *held = left;
+    }
+    if (!supplied)
+        shared_access(sys, address, 0, B);
+    return 0;
+}
+
+/** @brief simulate the trace on coherent private caches. The records are
+ *         simulated in trace order, which is the interleaving of the
+ *         cores.
+ *
+ *  @param[in]     reader    Opened trace, read until its end.
+ *  @param[in,out] sys       Initialized caches, the private ones freed on
+ *                           return.
+ *  @return 0 on success, -1 if the memory could not be allocated, -2 if a
+ *          core is not below MAX_CORES.
+ */
+int simulate_coherent(trace_reader_t *reader, coherent_t *sys) {
+    const trace_record_t *batch;
+    size_t n;
+    int status = 0;
+    while (status == 0 && (n = read_batch(reader, &batch)) > 0) {
+        for (size_t i = 0; status == 0 && i < n; i++) {
+            if (batch[i].op != 'L' && batch[i].op != 'S')
+                continue;
+            if (batch[i].core >= MAX_CORES)
+                status = -2;
+            else
+                status = coherent_access(sys, batch[i].core,
+                                         batch[i].address,
+                                         batch[i].op == 'S', batch[i].size);
+        }
+    }
+    for (int i = 0; i < MAX_CORES; i++) {
+        if (sys->present & (1u << i))
+            free_cache(&sys->cache[i]);
+    }
+    map_free(&sys->directory);
+    if (sys->shared != NULL) {
+        for (int i = 0; i < sys->shared->levels; i++)
+            free_cache(&sys->shared->level[i]);
+    }
+    return status;
+}
+
+/* Bits of the byte mask a thread keeps for a block; larger blocks give
+ * each bit B / SHARING_MASK_BITS bytes */
+#define SHARING_MASK_BITS 64
+
+/** Sharing history of a block: the threads holding a copy, as if every
+ *  thread had an unbounded private cache, and the invalidations a store
+ *  made. An invalidation is false sharing when the store touches no byte
+ *  the invalidated thread ever accessed in the block.
+ */
+typedef struct {
+    uint64_t block;
+    uint32_t holders;               /* threads with a valid copy */
+    uint32_t threads;               /* threads that accessed the block */
+    unsigned long invalidations;    /* copies invalidated by a store */
+    unsigned long false_sharing;    /* of which on disjoint bytes */
+} sharing_block_t;
+
+/** False-sharing detector over the blocks of a multi-threaded trace */
+typedef struct {
+    int b;
+    block_map_t index;  /* block -> position in block[] + 1 */
+    block_map_t mask;   /* block * MAX_CORES + thread -> bytes accessed */
+    sharing_block_t *block;
+    size_t count;
+    size_t capacity;
+} sharing_t;
+
+int init_sharing(sharing_t *sharing, int b) {
+    memset(sharing, 0, sizeof(*sharing));
+    sharing->b = b;
+    if (map_init(&sharing->index, 1024) != 0 ||
+        map_init(&sharing->mask, 1024) != 0)
+        return -1;
+    return 0;
+}
+
+void free_sharing(sharing_t *sharing) {
+    map_free(&sharing->index);
+    map_free(&sharing->mask);
+    free(sharing->block);
+    sharing->block = NULL;
+}
+
+/** @brief mask of the bytes [first, last] of a block, one bit per
+ *         B / SHARING_MASK_BITS bytes.
+ */
+static inline uint64_t byte_mask(int b, uint64_t first, uint64_t last) {
+    int shift = b > 6 ? b - 6 : 0;
+    uint64_t low = first >> shift, high = last >> shift;
+    uint64_t upper = high == SHARING_MASK_BITS - 1
+                         ? ~(uint64_t)0
+                         : ((uint64_t)1 << (high + 1)) - 1;
+    return upper & ~(((uint64_t)1 << low) - 1);
+}
+
+/** @brief record an access of a thread to a block. A store invalidates
+ *         the copies of the other threads.
+ *
+ *  @return 0 on success, -1 if the memory could not be allocated.
+ */
+static int sharing_touch(sharing_t *sharing, uint64_t block, int thread,
+                         uint64_t bytes, int store) {
+    uint64_t *slot = map_insert(&sharing->index, block);
+    if (slot == NULL)
+        return -1;
+    if (*slot == 0) {
+        if (sharing->count == sharing->capacity) {
+            size_t capacity = sharing->capacity ? 2 * sharing->capacity : 1024;
+            sharing_block_t *grown = realloc(
+                sharing->block, capacity * sizeof(sharing_block_t));
+            if (grown == NULL)
+                return -1;
+            sharing->block = grown;
+            sharing->capacity = capacity;
+        }
+        memset(&sharing->block[sharing->count], 0, sizeof(sharing_block_t));
+        sharing->block[sharing->count].block = block;
+        *slot = ++sharing->count;
+    }
+    sharing_block_t *entry = &sharing->block[*slot - 1];
+    uint32_t bit = (uint32_t)1 << thread;
+    uint32_t others = entry->holders & ~bit;
+    if (store && others != 0) {
+        for (uint32_t left = others; left != 0; left &= left - 1) {
+            uint64_t key = block * MAX_CORES + (uint64_t)__builtin_ctz(left);
+            uint64_t touched = *map_find(&sharing->mask, key);
+            entry->invalidations += 1;
+            entry->false_sharing += (touched & bytes) == 0;
+        }
+        entry->holders = 0;
+    }
+    entry->holders |= bit;
+    entry->threads |= bit;
+    uint64_t *mask = map_insert(&sharing->mask, block * MAX_CORES +
+                                                    (uint64_t)thread);
+    if (mask == NULL)
+        return -1;
+    *mask |= bytes;
+    return 0;
+}
+
+/** @brief record an access of a thread, split over the blocks it spans.
+ *
+ *  @return 0 on success, -1 if the memory could not be allocated.
+ */
+int sharing_access(sharing_t *sharing, const trace_record_t *rec) {
+    int b = sharing->b;
+    uint64_t offset_mask = ((uint64_t)1 << b) - 1;
+    uint64_t first = rec->address;
+    uint64_t last = first + (rec->size > 0 ? rec->size - 1 : 0);
+    for (uint64_t block = first >> b; block <= last >> b; block++) {
+        uint64_t from = block == first >> b ? first & offset_mask : 0;
+        uint64_t to = block == last >> b ? last & offset_mask : offset_mask;
+        if (sharing_touch(sharing, block, rec->core,
+                          byte_mask(b, from, to), rec->op == 'S') != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/** @brief order blocks by false-sharing invalidations, then by all
+ *         invalidations, most first.
+ */
+static int compare_sharing(const void *a, const void *b) {
+    const sharing_block_t *x = a, *y = b;
+    if (x->false_sharing != y->false_sharing)
+        return x->false_sharing < y->false_sharing ? 1 : -1;
+    if (x->invalidations != y->invalidations)
+        return x->invalidations < y->invalidations ? 1 : -1;
+    return x->block < y->block ? -1 : (x->block > y->block);
+}
+
+/** @brief print the top blocks with false sharing, with the bytes every
+ *         thread accessed in them.
+ *
+ *  @param[in,out] sharing   Detector fed with the whole trace; its blocks
+ *                           are sorted.
+ *  @param[in]     top       Number of blocks to report at most.
+ */
+void print_sharing(sharing_t *sharing, int top) {
+    unsigned long invalidations = 0, false_sharing = 0;
+    for (size_t i = 0; i < sharing->count; i++) {
+        invalidations += sharing->block[i].invalidations;
+        false_sharing += sharing->block[i].false_sharing;
+    }
+    printf("blocks:%zu invalidations:%lu false_sharing:%lu\n",
+           sharing->count, invalidations, false_sharing);
+    qsort(sharing->block, sharing->count, sizeof(sharing_block_t),
+          compare_sharing);
+    for (size_t i = 0; i < sharing->count && i < (size_t)top; i++) {
+        const sharing_block_t *entry = &sharing->block[i];
+        if (entry->false_sharing == 0)
+            break;
+        printf("block:%#lx address:%#lx invalidations:%lu "
+               "false_sharing:%lu",
+               (unsigned long)entry->block,
+               (unsigned long)(entry->block << sharing->b),
+               entry->invalidations, entry->false_sharing);
+        for (uint32_t left = entry->threads; left != 0; left &= left - 1) {
+            int thread = __builtin_ctz(left);
+            uint64_t key = entry->block * MAX_CORES + (uint64_t)thread;
+            printf(" t%d:%#llx", thread,
+                   (unsigned long long)*map_find(&sharing->mask, key));
+        }
+        printf("\n");
+    }
+}
+
+/* Default number of blocks fetched ahead by each prefetcher */
+#define PREFETCH_NEXT_DEGREE 1
+#define PREFETCH_STRIDE_DEGREE 2
+#define PREFETCH_STREAM_DEPTH 4
+/* Entries of the stride table, and bytes of the region indexing them */
+#define STRIDE_ENTRIES 256
+#define STRIDE_REGION_BITS 12
+/* Confidence a stride needs before it is followed, and its ceiling */
+#define STRIDE_CONFIDENT 2
+#define STRIDE_MAX_CONFIDENCE 3
+/* Number of stream buffers */
+#define STREAM_BUFFERS 16
+
+/** A region of the stride table */
+typedef struct {
+    uint64_t region; /* address >> STRIDE_REGION_BITS, + 1; 0 if unused */
+    uint64_t last;   /* last block accessed in the region */
+    int64_t stride;  /* blocks between its last two accesses */
+    int confidence;  /* times the stride repeated, saturating */
+} stride_entry_t;
+
+/** A stream buffer, fetching blocks ahead of its head */
+typedef struct {
+    uint64_t head; /* last triggering block of the stream */
+    int dir;       /* +1 or -1, 0 until the second trigger */
+    uint64_t used; /* clock of its last trigger, 0 if unused */
+} stream_t;
+
+/** State of the prefetcher of a cache */
+typedef struct prefetcher {
+    prefetch_t kind;
+    int degree;
+    uint64_t clock; /* number of triggers, for the LRU stream buffer */
+    stride_entry_t stride[STRIDE_ENTRIES];
+    stream_t stream[STREAM_BUFFERS];
+    block_map_t polluted;  /* victim of a prefetch -> prefetched block + 1 */
+    block_map_t displaced; /* unused prefetched block -> its victim + 1 */
+} prefetcher_t;
+
+/** @brief attach a prefetcher to a cache.
+ *
+ *  @return 0 on success, -1 if the memory could not be allocated.
+ */
+int init_prefetcher(cache_t *cache, prefetch_t kind, int degree) {
+    prefetcher_t *pf = calloc(1, sizeof(prefetcher_t));
+    if (pf == NULL)
+        return -1;
+    pf->kind = kind;
+    pf->degree = degree;
+    if (degree <= 0)
+        pf->degree = kind == PREFETCH_NEXT     ? PREFETCH_NEXT_DEGREE
+                     : kind == PREFETCH_STRIDE ? PREFETCH_STRIDE_DEGREE
+                                               : PREFETCH_STREAM_DEPTH;
+    cache->prefetcher = pf;
+    return map_init(&pf->polluted, 1024) != 0 ||
+                   map_init(&pf->displaced, 1024) != 0
+               ? -1
+               : 0;
+}
+
+void free_prefetcher(cache_t *cache) {
+    if (cache->prefetcher == NULL)
+        return;
+    map_free(&cache->prefetcher->polluted);
+    map_free(&cache->prefetcher->displaced);
+    free(cache->prefetcher);
+    cache->prefetcher = NULL;
+}
+
+/** @brief forget the victim of a prefetched block, once the block has
+ *         been used or evicted.
+ */
+static void forget_prefetched(prefetcher_t *pf, uint64_t block) {
+    uint64_t *victim = map_find(&pf->displaced, block);
+    if (victim == NULL)
+        return;
+    uint64_t victim_block = *victim - 1;
+    map_erase(&pf->displaced, block);
+    map_erase(&pf->polluted, victim_block);
+}
+
+/** @brief forget a block evicted by a prefetch, once it is back.
+ *
+ *  @return whether the block had been evicted by a prefetch still unused.
+ */
+static int forget_victim(prefetcher_t *pf, uint64_t block) {
+    uint64_t *prefetched = map_find(&pf->polluted, block);
+    if (prefetched == NULL)
+        return 0;
+    uint64_t prefetched_block = *prefetched - 1;
+    map_erase(&pf->polluted, block);
+    map_erase(&pf->displaced, prefetched_block);
+    return 1;
+}
+
+/** @brief fill a block into the cache as prefetched, unless it is
+ *         cached already. Its victim is remembered while the block stays
+ *         unused so that a miss on it meanwhile counts as pollution; both
+ *         maps are thus bounded by the lines of the cache.
+ */
+static void prefetch_block(cache_t *cache, int64_t block) {
+    // a stride can lead outside of the address space
+    if (block < 0 || (uint64_t)block > (~(uint64_t)0 >> cache->b))
+        return;
+    unsigned long tag = (unsigned long)block >> cache->s;
+    unsigned long set_num = (unsigned long)block & (cache->S - 1UL);
+    if (line_flags(cache, tag, set_num) != NULL)
+        return;
+    prefetcher_t *pf = cache->prefetcher;
+    forget_victim(pf, (uint64_t)block);
+    unsigned long hit = cache->hit, miss = cache->miss;
+    cache->evicted = 0;
+    cache->prefetching = 1;
+    count(cache, tag, set_num, 0);
+    cache->prefetching = 0;
+    cache->hit = hit;
+    cache->miss = miss;
+    *line_flags(cache, tag, set_num) |= LINE_PREFETCHED;
+    cache->prefetches += 1;
+    if (!cache->evicted)
+        return;
+    // the victim may itself be an unused prefetch
+    forget_prefetched(pf, cache->victim_block);
+    uint64_t *prefetched = map_insert(&pf->polluted, cache->victim_block);
+    if (prefetched == NULL)
+        return;
+    *prefetched = (uint64_t)block + 1;
+    uint64_t *victim = map_insert(&pf->displaced, (uint64_t)block);
+    if (victim != NULL)
+        *victim = cache->victim_block + 1;
+    else
+        map_erase(&pf->polluted, cache->victim_block);
+}
+
+/** @brief train the stride entry of the region of a block and follow a
+ *         confident stride.
+ */
+static void stride_access(cache_t *cache, prefetcher_t *pf, uint64_t block) {
+    uint64_t region = ((block << cache->b) >> STRIDE_REGION_BITS) + 1;
+    stride_entry_t *entry = &pf->stride[hash64(region) % STRIDE_ENTRIES];
+    if (entry->region != region) {
+        entry->region = region;
+        entry->last = block;
+        entry->stride = 0;
+        entry->confidence = 0;
+        return;
+    }
+    int64_t delta = (int64_t)(block - entry->last);
+    if (delta == 0)
+        return;
+    if (delta == entry->stride) {
+        if (entry->confidence < STRIDE_MAX_CONFIDENCE)
+            entry->confidence += 1;
+    } else if (entry->confidence > 0) {
+        entry->confidence -= 1;
+    } else {
+        entry->stride = delta;
+    }
+    entry->last = block;
+    if (entry->confidence < STRIDE_CONFIDENT)
+        return;
+    for (int k = 1; k <= pf->degree; k++)
+        prefetch_block(cache, (int64_t)block + k * entry->stride);
+}
+
+/** @brief advance the stream buffer a trigger falls in, or start one in
+ *         place of the least recently triggered.
+ */
+static void stream_trigger(cache_t *cache, prefetcher_t *pf,
+                           uint64_t block) {
+    stream_t *lru = &pf->stream[0];
+    pf->clock += 1;
+    for (int i = 0; i < STREAM_BUFFERS; i++) {
+        stream_t *stream = &pf->stream[i];
+        if (stream->used < lru->used)
+            lru = stream;
+        if (stream->used == 0)
+            continue;
+        int64_t ahead = (int64_t)(block - stream->head);
+        int64_t distance = stream->dir != 0 ? ahead * stream->dir
+                                            : (ahead < 0 ? -ahead : ahead);
+        if (distance < 1 || distance > pf->degree)
+            continue;
+        if (stream->dir == 0)
+            stream->dir = ahead > 0 ? 1 : -1;
+        stream->head = block;
+        stream->used = pf->clock;
+        for (int k = 1; k <= pf->degree; k++)
+            prefetch_block(cache, (int64_t)block + k * stream->dir);
+        return;
+    }
+    lru->head = block;
+    lru->dir = 0;
+    lru->used = pf->clock;
+}
+
+/** @brief simulate a batch on a cache with a prefetcher: every demand
+ *         access goes through count_write(), then the prefetcher sees it.
+ */
+static void kernel_prefetch(cache_t *cache, const trace_record_t *rec,
+                            size_t n) {
+    prefetcher_t *pf = cache->prefetcher;
+    int s = cache->s, b = cache->b;
+    unsigned long set_mask = (unsigned long)(cache->S - 1);
+    for (size_t i = 0; i < n; i++) {
+        if (rec[i].op != 'L' && rec[i].op != 'S')
+            continue;
+        uint64_t block = rec[i].address >> b;
+        unsigned long tag = block >> s, set_num = block & set_mask;
+        unsigned char *flags = line_flags(cache, tag, set_num);
+        int prefetched = flags != NULL && (*flags & LINE_PREFETCHED);
+        int hit = count_write(cache, tag, set_num, rec[i].op == 'S',
+                              rec[i].size);
+        if (hit > 0 && prefetched) {
+            cache->useful_prefetches += 1;
+            *flags &= (unsigned char)~LINE_PREFETCHED;
+            forget_prefetched(pf, block);
+        } else if (hit <= 0 && forget_victim(pf, block)) {
+            cache->pollution_misses += 1;
+        }
+        if (hit >= 0 && cache->evicted)
+            forget_prefetched(pf, cache->victim_block);
+        int trigger = hit <= 0 || prefetched;
+        if (pf->kind == PREFETCH_STRIDE)
+            stride_access(cache, pf, block);
+        else if (trigger && pf->kind == PREFETCH_NEXT)
+            for (int k = 1; k <= pf->degree; k++)
+                prefetch_block(cache, (int64_t)block + k);
+        else if (trigger)
+            stream_trigger(cache, pf, block);
+    }
+}
+
+/** Next-use position of every load and store of a trace, in a side file
+ *  mapped into memory so that traces larger than memory can be handled
+ */
 typedef struct {
-    int valid_bit;     /* whether the line is valid */
-    int dirty_bit;     /* whether the line is modified */
-    unsigned long tag; /* the tag of the line */
-} cache_line;
-
-/* Use a queue (implemented with doubly linked list) to keep track of LRU */
-typedef struct queue_node {
-    struct queue_node *prev;
-    cache_line *line;
-    struct queue_node *next;
-} queue_node_t;
+    uint64_t *next; /* mapped positions, NEXT_USE_NEVER past the last use */
+    size_t count;   /* number of accesses */
+} next_use_t;
 
-typedef struct queue_set {
-    queue_node_t *head; /* head of the queue, most recently used node */
-    queue_node_t *tail; /* tail of the queue, least recently used node */
-    int curr_line_num;  /* current number of nodes in the set */
-} queue_set_t;
+void free_next_use(next_use_t *uses) {
+    if (uses->next != NULL)
+        munmap(uses->next, uses->count * sizeof(uint64_t));
+    uses->next = NULL;
+}
 
-/** initialize global variables
- *  hit: count number of hits.
- *  miss: count number of misses.
- *  eviction: count number of evictions.
- *  dirty_count: count number of lines which the dirty bit is set to 1.
- *  dirty_eviction: count number of evictions that the dirty bit is set to 1.
- *  s   number of set bits
- *  S   number of set, can be calculated by S = 2^s
- *  b   number of bits that represent byte offset
- *  B   number of bytes in a block, can be calculated by B = 2^b
- *  t   number of tag bits, t = 64 - s - b
- *  E   number of line per set
+/** @brief compute the next-use position of every access of a trace at
+ *         block granularity. A forward pass writes the block of every
+ *         access to an unnamed temporary file; the file is then mapped and
+ *         walked backwards, each block being overwritten with the position
+ *         of the next access to it.
+ *
+ *  @param[in]     reader    Opened trace, read until its end.
+ *  @param[in]     b         Number of block offset bits.
+ *  @param[out]    uses      Mapped positions, released with free_next_use().
+ *  @return 0 on success, -1 if the side file could not be written or the
+ *          memory could not be allocated.
+ */
+int build_next_use(trace_reader_t *reader, int b, next_use_t *uses) {
+    memset(uses, 0, sizeof(*uses));
+    FILE *side = tmpfile();
+    if (side == NULL)
+        return -1;
+    const trace_record_t *batch;
+    size_t n;
+    int ok = 1;
+    while (ok && (n = read_batch(reader, &batch)) > 0) {
+        uint64_t block[RECORD_BATCH];
+        size_t m = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (batch[i].op == 'L' || batch[i].op == 'S')
+                block[m++] = batch[i].address >> b;
+        }
+        ok = fwrite(block, sizeof(uint64_t), m, side) == m;
+        uses->count += m;
+    }
+    ok = ok && fflush(side) == 0;
+    if (ok && uses->count > 0) {
+        // the mapping outlives the file, which is deleted once closed
+        void *data = mmap(NULL, uses->count * sizeof(uint64_t),
+                          PROT_READ | PROT_WRITE, MAP_SHARED, fileno(side),
+                          0);
+        ok = data != MAP_FAILED;
+        uses->next = ok ? data : NULL;
+    }
+    fclose(side);
+    block_map_t last;
+    if (!ok || map_init(&last, 1024) != 0) {
+        free_next_use(uses);
+        return -1;
+    }
+
+    // the map holds the position + 1 of the latest access seen to a block
+    for (size_t i = uses->count; ok && i-- > 0;) {
+        uint64_t *seen = map_insert(&last, uses->next[i]);
+        if (seen == NULL) {
+            ok = 0;
+            break;
+        }
+        uses->next[i] = *seen != 0 ? *seen - 1 : NEXT_USE_NEVER;
+        *seen = (uint64_t)i + 1;
+    }
+    map_free(&last);
+    if (!ok) {
+        free_next_use(uses);
+        return -1;
+    }
+    if (uses->next != NULL)
+        madvise(uses->next, uses->count * sizeof(uint64_t), MADV_SEQUENTIAL);
+    return 0;
+}
+
+/* Initial number of time slots of the reuse-distance tree */
+#define REUSE_MIN_SLOTS 65536
+
+/** Exact LRU reuse distances at block granularity (Olken's algorithm).
+ *  Every block remembers the time of its last access, and a Fenwick tree
+ *  over time holds a 1 at the last access time of every block, so the
+ *  distance of an access is the number of ones after the previous access
+ *  of its block. Once the clock reaches the end of the tree, the live
+ *  times are renumbered 0..M-1 and the tree is rebuilt with 2M slots, so
+ *  memory stays proportional to the footprint M, not to the trace length.
+ */
+typedef struct {
+    block_map_t last; /* block -> time of its last access + 1 */
+    uint32_t *tree;   /* Fenwick tree over time slots */
+    size_t slots;     /* number of time slots of the tree */
+    size_t now;       /* time of the next access */
+} reuse_sim_t;
+
+/* Distance returned for the first access of a block */
+#define DISTANCE_COLD SIZE_MAX
+
+int init_reuse_sim(reuse_sim_t *sim) {
+    sim->slots = REUSE_MIN_SLOTS;
+    sim->now = 0;
+    sim->tree = calloc(sim->slots, sizeof(uint32_t));
+    if (map_init(&sim->last, 1024) != 0 || sim->tree == NULL)
+        return -1;
+    return 0;
+}
+
+void free_reuse_sim(reuse_sim_t *sim) {
+    map_free(&sim->last);
+    free(sim->tree);
+    sim->tree = NULL;
+}
+
+/** @brief add v at time slot i of the tree. */
+static inline void tree_add(reuse_sim_t *sim, size_t i, int v) {
+    for (; i < sim->slots; i |= i + 1)
+        sim->tree[i] += (uint32_t)v;
+}
+
+/** @brief number of ones in time slots 0..i of the tree. */
+static inline size_t tree_prefix(const reuse_sim_t *sim, size_t i) {
+    size_t sum = 0;
+    for (size_t j = i + 1; j > 0; j &= j - 1)
+        sum += sim->tree[j - 1];
+    return sum;
+}
+
+/** @brief renumber the last access times of the blocks 0..M-1 in order
+ *         and rebuild the tree with room for M more accesses.
+ *
+ *  @return 0 on success, -1 if the memory could not be allocated.
  */
-int hit = 0;
-int miss = 0;
-int eviction = 0;
-int dirty_count = 0;
-int dirty_eviction = 0;
-int s, E, b, S, B, t;
+static int reuse_compact(reuse_sim_t *sim) {
+    size_t live = sim->last.count;
+    size_t slots = 2 * live > REUSE_MIN_SLOTS ? 2 * live : REUSE_MIN_SLOTS;
+    // every time holds at most one block, so bucket the slots by time
+    size_t *by_time = malloc(sim->now * sizeof(size_t));
+    uint32_t *tree = calloc(slots, sizeof(uint32_t));
+    if (by_time == NULL || tree == NULL) {
+        free(by_time);
+        free(tree);
+        return -1;
+    }
+    for (size_t t = 0; t < sim->now; t++)
+        by_time[t] = SIZE_MAX;
+    for (size_t i = 0; i <= sim->last.mask; i++) {
+        if (sim->last.value[i] != 0)
+            by_time[sim->last.value[i] - 1] = i;
+    }
+    size_t next = 0;
+    for (size_t t = 0; t < sim->now; t++) {
+        if (by_time[t] != SIZE_MAX)
+            sim->last.value[by_time[t]] = ++next;
+    }
+    // linear-time build of a tree with ones at 0..live-1
+    for (size_t i = 0; i < live; i++)
+        tree[i] = 1;
+    for (size_t i = 0; i < slots; i++) {
+        size_t j = i | (i + 1);
+        if (j < slots)
+            tree[j] += tree[i];
+    }
+    free(by_time);
+    free(sim->tree);
+    sim->tree = tree;
+    sim->slots = slots;
+    sim->now = live;
+    return 0;
+}
 
-/** @brief update the number of hit, miss, eviction and dirty eviction and
- *         store in the global variables, with the given tag and set index.
+/** @brief access a block and return its reuse distance: the number of
+ *         distinct blocks accessed since its previous access, or
+ *         DISTANCE_COLD for its first access.
  *
- *  @param[in]     cache          Pointer to the dynamically allocated cache.
- *  @param[in]     curr_tag       Tag bits computed using the address.
- *  @param[in]     curr_set_num   Set index computed using the address.
- *  @param[in]     dirty          Set to 0 if it's a load operation,
- *                                to 1 if it's a store operation.
+ *  @return the distance, or DISTANCE_COLD - 1 if the memory ran out.
  */
-void count(queue_set_t *cache, unsigned long curr_tag,
-           unsigned long curr_set_num, int dirty) {
-    int operation_complete = 0;
-
-    // check hit by searching for the line with the same tag
-    queue_node_t *check_node = cache[curr_set_num].head;
-    while (check_node != NULL) {
-        cache_line *check_line = check_node->line;
-        if (check_line != NULL && check_line->valid_bit != 0 &&
-            check_line->tag == curr_tag) {
-            hit += 1;
-            // if the operation is store, mark the dirty bit of the line
-            if (dirty == 1)
-                check_line->dirty_bit = 1;
-            // move the node to the most recently used
-            queue_node_t *prev_node = check_node->prev;
-            if (prev_node != NULL) {
-                // if the current node is the least recently used
-                if (cache[curr_set_num].tail == check_node) {
-                    cache[curr_set_num].tail = prev_node;
-                } else {
-                    // if not the least recently used, the next node != NULL
-                    check_node->next->prev = prev_node;
-                }
-                prev_node->next = check_node->next;
-                check_node->prev = NULL;
-                check_node->next = cache[curr_set_num].head;
-                cache[curr_set_num].head->prev = check_node;
-                cache[curr_set_num].head = check_node;
-            }
+static size_t reuse_access(reuse_sim_t *sim, uint64_t block) {
+    if (sim->now == sim->slots && reuse_compact(sim) != 0)
+        return DISTANCE_COLD - 1;
+    uint64_t *last = map_insert(&sim->last, block);
+    if (last == NULL)
+        return DISTANCE_COLD - 1;
+    size_t distance = DISTANCE_COLD;
+    if (*last != 0) {
+        size_t t = *last - 1;
+        distance = sim->last.count - tree_prefix(sim, t);
+        tree_add(sim, t, -1);
+    }
+    *last = sim->now + 1;
+    tree_add(sim, sim->now, 1);
+    sim->now += 1;
+    return distance;
+}
+
+/** @brief forget a block, as if it had never been accessed. */
+static void reuse_forget(reuse_sim_t *sim, uint64_t block) {
+    uint64_t *last = map_find(&sim->last, block);
+    if (last != NULL) {
+        tree_add(sim, *last - 1, -1);
+        map_erase(&sim->last, block);
+    }
+}
+
+/** Histogram of reuse distances. Bin i counts the distances from i * width
+ *  to (i + 1) * width - 1. The histogram grows with the largest distance
+ *  seen; with max_bins set, it instead doubles the width of its bins so
+ *  that its memory stays bounded.
+ */
+typedef struct {
+    double *count; /* accesses in each bin, weighted */
+    size_t len;
+    size_t width;    /* distances per bin, a power of two */
+    size_t max_bins; /* bound on len, 0 for none */
+    double cold;     /* first accesses of a block */
+    double accesses; /* every access */
+} reuse_hist_t;
+
+/** @brief add weight accesses at the given distance.
+ *
+ *  @return 0 on success, -1 if the histogram could not grow.
+ */
+static int hist_add(reuse_hist_t *hist, size_t distance, double weight) {
+    hist->accesses += weight;
+    if (distance == DISTANCE_COLD) {
+        hist->cold += weight;
+        return 0;
+    }
+    if (hist->width == 0)
+        hist->width = 1;
+    while (hist->max_bins != 0 && distance / hist->width >= hist->max_bins) {
+        // merge pairs of bins
+        for (size_t i = 0; i < hist->len; i += 2)
+            hist->count[i / 2] = hist->count[i] +
+                                 (i + 1 < hist->len ? hist->count[i + 1] : 0);
+        memset(hist->count + (hist->len + 1) / 2, 0,
+               (hist->len - (hist->len + 1) / 2) * sizeof(double));
+        hist->width *= 2;
+    }
+    distance /= hist->width;
+    if (distance >= hist->len) {
+        size_t len = hist->len ? hist->len : 1024;
+        while (len <= distance)
+            len *= 2;
+        if (hist->max_bins != 0 && len > hist->max_bins)
+            len = hist->max_bins;
+        double *count = realloc(hist->count, len * sizeof(double));
+        if (count == NULL)
+            return -1;
+        memset(count + hist->len, 0, (len - hist->len) * sizeof(double));
+        hist->count = count;
+        hist->len = len;
+    }
+    hist->count[distance] += weight;
+    return 0;
+}
+
+/** @brief print the miss-ratio curve of a fully associative LRU cache of
+ *         every size from 1 block up to the footprint. A cache of c blocks
+ *         misses the accesses of distance c or more, so the curve only
+ *         steps where a bin of distances is not empty; one row is printed
+ *         per step and holds up to the next row.
+ *
+ *  @param[in]     hist      Distances of every access.
+ *  @param[in]     b         Block bits, to print sizes in bytes.
+ *  @param[in]     samples   Accesses actually measured when the histogram
+ *                           is estimated from a sample, to print the
+ *                           standard error of every ratio; 0 if exact.
+ */
+void print_mrc(const reuse_hist_t *hist, int b, double samples) {
+    size_t width = hist->width ? hist->width : 1;
+    double misses = hist->accesses;
+    for (size_t i = 0; i == 0 || i < hist->len; i++) {
+        double at = i < hist->len ? hist->count[i] : 0;
+        misses -= at;
+        if (i > 0 && at == 0)
+            continue;
+        size_t c = (i + 1) * width;
+        double ratio = hist->accesses > 0 ? misses / hist->accesses : 0;
+        ratio = ratio < 0 ? 0 : (ratio > 1 ? 1 : ratio);
+        printf("size:%zu bytes:%lu miss_ratio:%.6f", c, (unsigned long)c << b,
+               ratio);
+        if (samples > 0)
+            printf(" stderr:%.6f", sqrt(ratio * (1 - ratio) / samples));
+        printf("\n");
+    }
+}
+
+/* Sampling hashes are compared against a threshold out of this modulus */
+#define SHARDS_MODULUS (1u << 24)
+/* Bins of the histogram of a sampled curve */
+#define SHARDS_MAX_BINS 65536
+
+/** A sampled block, ordered in a max-heap by its sampling hash */
+typedef struct {
+    uint64_t value;
+    uint64_t block;
+} shards_entry_t;
+
+/** SHARDS spatially hashed sampling of reuse distances. A block is sampled
+ *  iff its hash modulo SHARDS_MODULUS is below the threshold, so the rate
+ *  is threshold / SHARDS_MODULUS, and the distances measured among sampled
+ *  blocks are scaled up by 1 / rate. With max_samples set, the sampled
+ *  blocks are bounded: once there are too many, the ones with the largest
+ *  hash are forgotten, the threshold drops to their hash, and the counts
+ *  gathered so far are scaled down by new rate / old rate to stand for
+ *  the smaller sample.
+ */
+typedef struct {
+    reuse_sim_t sim;      /* reuse distances among sampled blocks */
+    reuse_hist_t hist;    /* scaled distances of the sampled accesses */
+    uint64_t threshold;   /* sampled blocks have a hash below it */
+    size_t max_samples;   /* bound on sampled blocks, 0 for none */
+    shards_entry_t *heap; /* sampled blocks, largest hash first */
+    size_t heap_len;
+    unsigned long accesses; /* every load and store */
+    unsigned long sampled;  /* loads and stores of sampled blocks */
+} shards_t;
+
+/** @brief start sampling at the given rate, keeping at most max_samples
+ *         blocks if it is not 0.
+ *
+ *  @return 0 on success, -1 if the memory could not be allocated.
+ */
+int init_shards(shards_t *shards, double rate, size_t max_samples) {
+    memset(shards, 0, sizeof(*shards));
+    shards->threshold = (uint64_t)(rate * SHARDS_MODULUS);
+    if (shards->threshold > SHARDS_MODULUS)
+        shards->threshold = SHARDS_MODULUS;
+    shards->max_samples = max_samples;
+    shards->hist.max_bins = SHARDS_MAX_BINS;
+    if (max_samples != 0) {
+        shards->heap = malloc((max_samples + 1) * sizeof(shards_entry_t));
+        if (shards->heap == NULL)
+            return -1;
+    }
+    return init_reuse_sim(&shards->sim);
+}
+
+/** @brief current sampling rate. */
+static inline double shards_rate(const shards_t *shards) {
+    return (double)shards->threshold / SHARDS_MODULUS;
+}
+
+/** @brief add a sampled block to the max-heap. */
+static void heap_push(shards_t *shards, uint64_t value, uint64_t block) {
+    size_t i = shards->heap_len++;
+    while (i > 0 && shards->heap[(i - 1) / 2].value < value) {
+        shards->heap[i] = shards->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    shards->heap[i].value = value;
+    shards->heap[i].block = block;
+}
+
+/** @brief remove the sampled block with the largest hash. */
+static shards_entry_t heap_pop(shards_t *shards) {
+    shards_entry_t top = shards->heap[0];
+    shards_entry_t last = shards->heap[--shards->heap_len];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= shards->heap_len)
+            break;
+        if (child + 1 < shards->heap_len &&
+            shards->heap[child + 1].value > shards->heap[child].value)
+            child++;
+        if (shards->heap[child].value <= last.value)
+            break;
+        shards->heap[i] = shards->heap[child];
+        i = child;
+    }
+    if (shards->heap_len > 0)
+        shards->heap[i] = last;
+    return top;
+}
+
+/** @brief lower the threshold to the largest sampled hash, forgetting the
+ *         blocks that have it, and rescale the histogram to the new rate.
+ */
+static void shards_shrink(shards_t *shards) {
+    double old_rate = shards_rate(shards);
+    uint64_t value = shards->heap[0].value;
+    while (shards->heap_len > 0 && shards->heap[0].value == value)
+        reuse_forget(&shards->sim, heap_pop(shards).block);
+    shards->threshold = value;
+    double scale = shards_rate(shards) / old_rate;
+    for (size_t i = 0; i < shards->hist.len; i++)
+        shards->hist.count[i] *= scale;
+    shards->hist.cold *= scale;
+    shards->hist.accesses *= scale;
+}
+
+/** @brief sample one access of a block.
+ *
+ *  @return 0 on success, -1 if the memory ran out.
+ */
+static int shards_access(shards_t *shards, uint64_t block) {
+    shards->accesses += 1;
+    // the map indexes with the low bits of the same hash, sample on the
+    // high ones so that sampled blocks do not share slots
+    uint64_t value = hash64(block) >> 40;
+    if (value >= shards->threshold)
+        return 0;
+    double rate = shards_rate(shards);
+    size_t distance = reuse_access(&shards->sim, block);
+    if (distance == DISTANCE_COLD - 1)
+        return -1;
+    shards->sampled += 1;
+    if (distance != DISTANCE_COLD)
+        distance = (size_t)((double)distance / rate);
+    if (hist_add(&shards->hist, distance, 1) != 0)
+        return -1;
+    if (distance == DISTANCE_COLD && shards->max_samples != 0) {
+        heap_push(shards, value, block);
+        if (shards->sim.last.count > shards->max_samples)
+            shards_shrink(shards);
+    }
+    return 0;
+}
+
+/** @brief correct the histogram for the difference between the expected
+ *         and the actual number of sampled accesses (SHARDS-adj): the
+ *         difference goes to the smallest distance, which is where the
+ *         sampling error concentrates.
+ */
+void shards_adjust(shards_t *shards) {
+    double missing = (double)shards->accesses * shards_rate(shards) -
+                     shards->hist.accesses;
+    hist_add(&shards->hist, 0, missing);
+}
+
+void free_shards(shards_t *shards) {
+    free_reuse_sim(&shards->sim);
+    free(shards->hist.count);
+    free(shards->heap);
+}
+
+/** All-associativity simulation of LRU caches with 2^smin to 2^smax sets
+ *  and 1 to Emax ways (Hill and Smith). With bit selection, the set of a
+ *  block at a finer level is a subset of its set at a coarser one, so one
+ *  recency stack per set of the coarsest level is enough: the distance of
+ *  a block in the cache with 2^k sets is the number of blocks above it in
+ *  that stack whose low k block bits match its own.
+ *
+ *  An entry that has Emax blocks of its finest set above it misses in every
+ *  simulated cache when it comes back, and those blocks keep every other
+ *  distance it contributes to at Emax or more, so the entry is dropped.
+ *  A stack therefore never holds more than Emax << (smax - smin) entries.
+ */
+typedef struct {
+    int smin, smax, Emax, b;
+    size_t capacity;          /* entries per stack */
+    uint64_t *block;          /* stacks of block numbers, MRU first */
+    uint32_t *fine_depth;     /* blocks above an entry in its finest set */
+    size_t *depth;            /* entries of each stack */
+    unsigned long accesses;   /* loads and stores simulated */
+    unsigned long *hits_at;   /* per level, accesses found at each distance */
+} forest_sim_t;
+
+/** @brief allocate empty stacks for the coarsest level.
+ *
+ *  @return 0 on success, -1 if the arguments are out of range or the memory
+ *          could not be allocated.
+ */
+int init_forest_sim(forest_sim_t *sim, int smin, int smax, int Emax, int b) {
+    memset(sim, 0, sizeof(*sim));
+    if (smin < 0 || smax < smin || smax - smin > 24 || Emax < 1)
+        return -1;
+    sim->smin = smin;
+    sim->smax = smax;
+    sim->Emax = Emax;
+    sim->b = b;
+    sim->capacity = (size_t)Emax << (smax - smin);
+    size_t stacks = (size_t)1 << smin;
+    sim->block = malloc(stacks * sim->capacity * sizeof(uint64_t));
+    sim->fine_depth = malloc(stacks * sim->capacity * sizeof(uint32_t));
+    sim->depth = calloc(stacks, sizeof(size_t));
+    sim->hits_at = calloc((size_t)(smax - smin + 1) * (size_t)Emax,
+                          sizeof(unsigned long));
+    if (sim->block == NULL || sim->fine_depth == NULL || sim->depth == NULL ||
+        sim->hits_at == NULL)
+        return -1;
+    return 0;
+}
+
+/** @brief move a block to the top of its stack, recording its distance at
+ *         every level and dropping the entries that can no longer hit.
+ */
+static void forest_access(forest_sim_t *sim, uint64_t x) {
+    int levels = sim->smax - sim->smin + 1;
+    size_t stack = (size_t)(x & ((1UL << sim->smin) - 1));
+    uint64_t *block = sim->block + stack * sim->capacity;
+    uint32_t *fine = sim->fine_depth + stack * sim->capacity;
+    size_t n = sim->depth[stack];
+    // above[l] counts the blocks above x sharing exactly l more set bits
+    unsigned long above[ADDRESS_BITS + 1] = {0};
+    sim->accesses += 1;
 
-            // mark the operation as complete
-            operation_complete = 1;
+    // shift the entries above x down by one, compacting dropped ones
+    uint64_t carry_block = x;
+    uint32_t carry_fine = 0;
+    size_t w = 0, i = 0;
+    int found = 0;
+    for (; i < n; i++) {
+        uint64_t y = block[i];
+        if (y == x) {
+            found = 1;
             break;
         }
-        check_node = check_node->next;
+        int common = __builtin_ctzll(x ^ y);
+        int level = (common < sim->smax ? common : sim->smax) - sim->smin;
+        above[level] += 1;
+        uint32_t depth = fine[i];
+        if (common >= sim->smax && ++depth >= (uint32_t)sim->Emax)
+            continue;
+        block[w] = carry_block;
+        fine[w] = carry_fine;
+        w++;
+        carry_block = y;
+        carry_fine = depth;
     }
+    block[w] = carry_block;
+    fine[w] = carry_fine;
+    w++;
+    if (found) {
+        // x itself is gone from position i, the rest keeps its order
+        memmove(block + w, block + i + 1, (n - i - 1) * sizeof(*block));
+        memmove(fine + w, fine + i + 1, (n - i - 1) * sizeof(*fine));
+        w += n - i - 1;
 
-    // if not hit, then there is a miss
-    if (operation_complete == 0) {
-        miss += 1;
-        // create a new line that will be inserted to the cache
-        cache_line *new_line = malloc(sizeof(cache_line));
-        new_line->tag = curr_tag;
-        new_line->valid_bit = 1;
-        new_line->dirty_bit = dirty;
-        queue_node_t *new_node = malloc(sizeof(queue_node_t));
-        new_node->line = new_line;
-        if (cache[curr_set_num].curr_line_num >= E) {
-            eviction += 1;
-            queue_node_t *evict_node = cache[curr_set_num].tail;
-            if (evict_node != NULL && evict_node->prev != NULL) {
-                // if E is greater than 1, the previous node exists
-                queue_node_t *prev_node = evict_node->prev;
-                evict_node->prev = NULL;
-                prev_node->next = NULL;
-                cache[curr_set_num].tail = prev_node;
-            } else if (cache[curr_set_num].curr_line_num == 1) {
-                // if E is equal to 1
-                cache[curr_set_num].head = NULL;
-                cache[curr_set_num].tail = NULL;
-            }
-            if (evict_node->line->dirty_bit == 1) {
-                dirty_eviction += 1;
-            }
-            // free the evicted lines and nodes
-            free(evict_node->line);
-            free(evict_node);
-            cache[curr_set_num].curr_line_num -= 1;
-        }
-        // insert the new node
-        new_node->prev = NULL;
-        new_node->next = cache[curr_set_num].head;
-        if (cache[curr_set_num].head != NULL) {
-            // if there is any node in the set before
-            cache[curr_set_num].head->prev = new_node;
-        } else {
-            // if there is no node in the set before
-            cache[curr_set_num].tail = new_node;
+        // the distance at a level counts the blocks sharing at least as
+        // many set bits as the level has
+        unsigned long distance = 0;
+        for (int l = levels - 1; l >= 0; l--) {
+            distance += above[l];
+            if (distance < (unsigned long)sim->Emax)
+                sim->hits_at[(size_t)l * (size_t)sim->Emax + distance] += 1;
         }
-        cache[curr_set_num].head = new_node;
-        cache[curr_set_num].curr_line_num += 1;
-        operation_complete = 1;
     }
+    sim->depth[stack] = w;
 }
 
-/** @brief free cache while counting how many dirty bits exist,
- *         store in the globle variable dirty_count
- *
- *  @param[in]     cache     Pointer to the dynamically allocated cache.
- */
-void free_cache(queue_set_t *cache) {
-    if (cache != NULL) {
-        /* Free the queue elements and the line structs */
-        for (int i = 0; i < S; i++) {
-            queue_node_t *qHead = cache[i].head;
-            while (qHead != NULL) {
-                if (qHead->line != NULL) {
-                    if (qHead->line->dirty_bit == 1) {
-                        dirty_count += 1;
-                    }
-                    free(qHead->line);
-                }
-                queue_node_t *qNext = qHead->next;
-                free(qHead);
-                qHead = qNext;
-            }
+/** @brief simulate a batch of records on every cache of the forest. */
+void forest_batch(forest_sim_t *sim, const trace_record_t *rec, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (rec[i].op == 'L' || rec[i].op == 'S')
+            forest_access(sim, rec[i].address >> sim->b);
+    }
+}
+
+/** @brief print the hits and misses of every cache of the forest, one row
+ *         per number of sets and associativity.
+ */
+void print_forest(const forest_sim_t *sim) {
+    for (int l = 0; l <= sim->smax - sim->smin; l++) {
+        unsigned long hits = 0;
+        for (int E = 1; E <= sim->Emax; E++) {
+            hits += sim->hits_at[(size_t)l * (size_t)sim->Emax + (size_t)E - 1];
+            printf("s:%d E:%d b:%d hits:%lu misses:%lu\n", sim->smin + l, E,
+                   sim->b, hits, sim->accesses - hits);
         }
     }
-    free(cache);
+}
+
+void free_forest_sim(forest_sim_t *sim) {
+    free(sim->block);
+    free(sim->fine_depth);
+    free(sim->depth);
+    free(sim->hits_at);
 }
 
 int main(int argc, char **argv) {
     // initialize static variables
-    char *file_path;
+    char *file_path = NULL;
+    char *convert_path = NULL;
+    char *sweep_spec = NULL;
+    char *level_spec = NULL;
+    char *mode = NULL;
+    double rate = 0;
+    size_t max_samples = 0;
     int opt;
+    int s = 0, E = 0, b = 0;
+    int s_max = -1;
+    int jobs = 1;
+    cache_options_t options = {ENGINE_AUTO, POLICY_LRU, 1, 2, 0, PREFETCH_NONE,
+                               0};
+    int report_writes = 0;
+    inclusion_t inclusion = INCLUSION_NINE;
+    int coherent = 0;
+    int top = 10;
+    protocol_t protocol = PROTOCOL_MESI;
 
     // get parameters about the cache and the path to the trace
-    while (-1 != (opt = getopt(argc, argv, "s:E:b:t:"))) {
+    const char *optstring =
+        "s:S:E:b:t:e:p:r:w:W:P:D:o:j:g:L:I:C:m:R:M:K:";
+    while (-1 != (opt = getopt(argc, argv, optstring))) {
         switch (opt) {
         case 's':
             s = atoi(optarg);
             break;
+        case 'S':
+            s_max = atoi(optarg);
+            break;
         case 'E':
             E = atoi(optarg);
             break;
@@ -201,53 +4966,527 @@ int main(int argc, char **argv) {
             }
             strcpy(file_path, optarg);
             break;
+        case 'P':
+            if (strcmp(optarg, "next") == 0) {
+                options.prefetch = PREFETCH_NEXT;
+            } else if (strcmp(optarg, "stride") == 0) {
+                options.prefetch = PREFETCH_STRIDE;
+            } else if (strcmp(optarg, "stream") == 0) {
+                options.prefetch = PREFETCH_STREAM;
+            } else {
+                printf("Unknown prefetcher %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'D':
+            options.prefetch_degree = atoi(optarg);
+            break;
+        case 'o':
+            convert_path = optarg;
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'g':
+            sweep_spec = optarg;
+            break;
+        case 'L':
+            level_spec = optarg;
+            break;
+        case 'I':
+            if (strcmp(optarg, "nine") == 0) {
+                inclusion = INCLUSION_NINE;
+            } else if (strcmp(optarg, "inclusive") == 0) {
+                inclusion = INCLUSION_INCLUSIVE;
+            } else if (strcmp(optarg, "exclusive") == 0) {
+                inclusion = INCLUSION_EXCLUSIVE;
+            } else {
+                printf("Unknown inclusion %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'C':
+            if (strcmp(optarg, "mesi") == 0) {
+                protocol = PROTOCOL_MESI;
+            } else if (strcmp(optarg, "moesi") == 0) {
+                protocol = PROTOCOL_MOESI;
+            } else {
+                printf("Unknown protocol %s\n", optarg);
+                return 0;
+            }
+            coherent = 1;
+            break;
+        case 'm':
+            mode = optarg;
+            break;
+        case 'R':
+            rate = atof(optarg);
+            break;
+        case 'M':
+            max_samples = (size_t)atol(optarg);
+            break;
+        case 'K':
+            top = atoi(optarg);
+            break;
+        case 'e':
+            if (strcmp(optarg, "list") == 0) {
+                options.engine = ENGINE_LIST;
+            } else if (strcmp(optarg, "age") == 0) {
+                options.engine = ENGINE_AGE;
+            } else if (strcmp(optarg, "matrix") == 0) {
+                options.engine = ENGINE_MATRIX;
+            } else if (strcmp(optarg, "direct") == 0) {
+                options.engine = ENGINE_DIRECT;
+            } else if (strcmp(optarg, "hash") == 0) {
+                options.engine = ENGINE_HASH;
+            } else {
+                printf("Unknown engine %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'p':
+            if (strcmp(optarg, "lru") == 0) {
+                options.policy = POLICY_LRU;
+            } else if (strcmp(optarg, "fifo") == 0) {
+                options.policy = POLICY_FIFO;
+            } else if (strcmp(optarg, "random") == 0) {
+                options.policy = POLICY_RANDOM;
+            } else if (strcmp(optarg, "lfu") == 0) {
+                options.policy = POLICY_LFU;
+            } else if (strcmp(optarg, "nru") == 0) {
+                options.policy = POLICY_NRU;
+            } else if (strcmp(optarg, "plru") == 0) {
+                options.policy = POLICY_PLRU;
+            } else if (strcmp(optarg, "srrip") == 0) {
+                options.policy = POLICY_SRRIP;
+            } else if (strcmp(optarg, "brrip") == 0) {
+                options.policy = POLICY_BRRIP;
+            } else if (strcmp(optarg, "drrip") == 0) {
+                options.policy = POLICY_DRRIP;
+            } else if (strcmp(optarg, "opt") == 0) {
+                options.policy = POLICY_OPT;
+            } else if (strcmp(optarg, "hawkeye") == 0) {
+                options.policy = POLICY_HAWKEYE;
+            } else if (strcmp(optarg, "arc") == 0) {
+                options.policy = POLICY_ARC;
+            } else if (strcmp(optarg, "lirs") == 0) {
+                options.policy = POLICY_LIRS;
+            } else {
+                printf("Unknown policy %s\n", optarg);
+                return 0;
+            }
+            break;
+        case 'r':
+            options.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'w':
+            options.rrpv_bits = atoi(optarg);
+            break;
+        case 'W':
+            if (strcmp(optarg, "wb") == 0) {
+                options.write = 0;
+            } else if (strcmp(optarg, "wt") == 0) {
+                options.write = WRITE_THROUGH;
+            } else if (strcmp(optarg, "wt-nwa") == 0) {
+                options.write = WRITE_THROUGH | WRITE_NO_ALLOCATE;
+            } else if (strcmp(optarg, "wb-nwa") == 0) {
+                options.write = WRITE_NO_ALLOCATE;
+            } else {
+                printf("Unknown write policy %s\n", optarg);
+                return 0;
+            }
+            report_writes = 1;
+            break;
         default:
             printf("Argument not valid\n");
             break;
         }
     }
 
-    // update the number of sets, byte offset and tag bits
-    S = 1 << s;
-    B = 1 << b;
-    t = ADDRESS_BITS - (s + b);
+    // convert the trace to the binary format instead of simulating it
+    if (convert_path != NULL) {
+        trace_reader_t reader;
+        if (open_trace(&reader, file_path) != 0) {
+            printf("Error in opening trace %s\n", file_path);
+            return 0;
+        }
+        long written = convert_trace(&reader, convert_path);
+        int failed = reader.error;
+        close_trace(&reader);
+        if (failed)
+            printf("Error in reading trace %s\n", file_path);
+        else if (written < 0)
+            printf("Error in writing trace %s\n", convert_path);
+        else
+            printf("Wrote %ld records to %s\n", written, convert_path);
+        free(file_path);
+        return 0;
+    }
 
-    // create cache: an array of sets
-    queue_set_t *cache = malloc(((size_t)S) * sizeof(queue_set_t));
-    for (int i = 0; i < S; i++) {
-        cache[i].head = NULL;
-        cache[i].tail = NULL;
-        cache[i].curr_line_num = 0;
+    init_match_tag();
+
+    // read the operations in the trace file, one batch at a time
+    trace_reader_t reader;
+    if (open_trace(&reader, file_path) != 0) {
+        printf("Error in opening trace %s\n", file_path);
+        return 0;
     }
+    cache_t cache;
 
-    // read the operations in the trace file
-    FILE *pFile = fopen(file_path, "r");
-    char operation;
-    unsigned long address;
-    int size;
+    // the single-pass modes derive every size from the LRU stack
+    if (mode != NULL && (options.policy != POLICY_LRU || options.write != 0 ||
+                         options.prefetch != PREFETCH_NONE)) {
+        printf("Mode %s only simulates write-back LRU without prefetching\n",
+               mode);
+        return 0;
+    }
+
+    // report every associativity from 1 to E with one stack simulation
+    if (mode != NULL && strcmp(mode, "stack") == 0) {
+        stack_sim_t sim;
+        if (init_stack_sim(&sim, s, E, b) != 0) {
+            printf("Error in memory allocation\n");
+            return 0;
+        }
+        const trace_record_t *batch;
+        size_t n;
+        while ((n = read_batch(&reader, &batch)) > 0)
+            stack_batch(&sim, batch, n);
+        if (reader.error) {
+            printf("Error in reading trace %s\n", file_path);
+            return 0;
+        }
+        for (int ways = 1; ways <= E; ways++) {
+            stack_counters(&sim, ways, &cache);
+            print_stats_row(&cache);
+        }
+        free_stack_sim(&sim);
+        close_trace(&reader);
+        free(file_path);
+        return 0;
+    }
+    // exact miss-ratio curve of a fully associative cache of any size
+    if (mode != NULL && strcmp(mode, "mrc") == 0) {
+        reuse_sim_t sim;
+        reuse_hist_t hist;
+        memset(&hist, 0, sizeof(hist));
+        if (init_reuse_sim(&sim) != 0) {
+            printf("Error in memory allocation\n");
+            return 0;
+        }
+        const trace_record_t *batch;
+        size_t n;
+        int ok = 1;
+        while (ok && (n = read_batch(&reader, &batch)) > 0) {
+            for (size_t i = 0; ok && i < n; i++) {
+                if (batch[i].op != 'L' && batch[i].op != 'S')
+                    continue;
+                size_t d = reuse_access(&sim, batch[i].address >> b);
+                ok = d != DISTANCE_COLD - 1 && hist_add(&hist, d, 1) == 0;
+            }
+        }
+        if (!ok) {
+            printf("Error in memory allocation\n");
+            return 0;
+        }
+        if (reader.error) {
+            printf("Error in reading trace %s\n", file_path);
+            return 0;
+        }
+        printf("footprint:%zu accesses:%.0f\n", sim.last.count,
+               hist.accesses);
+        print_mrc(&hist, b, 0);
+        free(hist.count);
+        free_reuse_sim(&sim);
+        close_trace(&reader);
+        free(file_path);
+        return 0;
+    }
+    // sampled miss-ratio curve in bounded memory
+    if (mode != NULL && strcmp(mode, "shards") == 0) {
+        // a fixed number of samples starts from sampling every block
+        if (rate <= 0)
+            rate = max_samples != 0 ? 1.0 : 0.01;
+        shards_t shards;
+        if (init_shards(&shards, rate, max_samples) != 0) {
+            printf("Error in memory allocation\n");
+            return 0;
+        }
+        const trace_record_t *batch;
+        size_t n;
+        int ok = 1;
+        while (ok && (n = read_batch(&reader, &batch)) > 0) {
+            for (size_t i = 0; ok && i < n; i++) {
+                if (batch[i].op == 'L' || batch[i].op == 'S')
+                    ok = shards_access(&shards, batch[i].address >> b) == 0;
+            }
+        }
+        if (!ok) {
+            printf("Error in memory allocation\n");
+            return 0;
+        }
+        if (reader.error) {
+            printf("Error in reading trace %s\n", file_path);
+            return 0;
+        }
+        shards_adjust(&shards);
+        printf("accesses:%lu sampled:%lu rate:%g samples:%zu\n",
+               shards.accesses, shards.sampled, shards_rate(&shards),
+               shards.sim.last.count);
+        print_mrc(&shards.hist, b, (double)shards.sampled);
+        free_shards(&shards);
+        close_trace(&reader);
+        free(file_path);
+        return 0;
+    }
+    // every set count from 2^s to 2^S and associativity up to E at once
+    if (mode != NULL && strcmp(mode, "forest") == 0) {
+        forest_sim_t sim;
+        if (init_forest_sim(&sim, s, s_max < 0 ? s : s_max, E, b) != 0) {
+            printf("Error in forest creation\n");
+            return 0;
+        }
+        const trace_record_t *batch;
+        size_t n;
+        while ((n = read_batch(&reader, &batch)) > 0)
+            forest_batch(&sim, batch, n);
+        if (reader.error) {
+            printf("Error in reading trace %s\n", file_path);
+            return 0;
+        }
+        print_forest(&sim);
+        free_forest_sim(&sim);
+        close_trace(&reader);
+        free(file_path);
+        return 0;
+    }
+    // blocks the threads ping-pong while touching disjoint bytes
+    if (mode != NULL && strcmp(mode, "sharing") == 0) {
+        sharing_t sharing;
+        if (init_sharing(&sharing, b) != 0) {
+            printf("Error in memory allocation\n");
+            return 0;
+        }
+        const trace_record_t *batch;
+        size_t n;
+        int status = 0;
+        while (status == 0 && (n = read_batch(&reader, &batch)) > 0) {
+            for (size_t i = 0; status == 0 && i < n; i++) {
+                if (batch[i].op != 'L' && batch[i].op != 'S')
+                    continue;
+                status = batch[i].core >= MAX_CORES
+                             ? -2
+                             : sharing_access(&sharing, &batch[i]);
+            }
+        }
+        if (status != 0) {
+            if (status == -2)
+                printf("Core id above %d\n", MAX_CORES - 1);
+            else
+                printf("Error in memory allocation\n");
+            return 0;
+        }
+        if (reader.error) {
+            printf("Error in reading trace %s\n", file_path);
+            return 0;
+        }
+        print_sharing(&sharing, top);
+        free_sharing(&sharing);
+        close_trace(&reader);
+        free(file_path);
+        return 0;
+    }
+    if (mode != NULL) {
+        printf("Unknown mode %s\n", mode);
+        return 0;
+    }
+
+    // private caches of every core over the levels of -L, if any
+    if (coherent) {
+        int *geometry = NULL;
+        int levels = 0;
+        if (level_spec != NULL &&
+            (levels = parse_geometries(level_spec, &geometry)) < 0) {
+            printf("Geometry list not valid\n");
+            return 0;
+        }
+        hierarchy_t h;
+        coherent_t *sys = malloc(sizeof(coherent_t));
+        if ((levels > 0 && init_hierarchy(&h, geometry, levels, &options,
+                                          inclusion) != 0) ||
+            sys == NULL ||
+            init_coherent(sys, s, E, b, &options, levels > 0 ? &h : NULL,
+                          protocol) != 0) {
+            printf("Error in cache creation\n");
+            return 0;
+        }
+        int status = simulate_coherent(&reader, sys);
+        if (status != 0) {
+            if (status == -2)
+                printf("Core id above %d\n", MAX_CORES - 1);
+            else
+                printf("Error in memory allocation\n");
+            return 0;
+        }
+        if (reader.error) {
+            printf("Error in reading trace %s\n", file_path);
+            return 0;
+        }
+        for (int i = 0; i < MAX_CORES; i++) {
+            if (!(sys->present & (1u << i)))
+                continue;
+            const coherence_stats_t *stats = &sys->stats[i];
+            printf("core%d ", i);
+            print_stats_row(&sys->cache[i]);
+            printf("core%d invalidations:%lu coherence_misses:%lu "
+                   "upgrades:%lu transfers:%lu writebacks:%lu\n",
+                   i, stats->invalidations, stats->coherence_misses,
+                   stats->upgrades, stats->transfers, stats->writebacks);
+        }
+        for (int i = 0; i < levels; i++) {
+            printf("L%d ", i + 2);
+            print_stats_row(&h.level[i]);
+        }
+        close_trace(&reader);
+        if (levels > 0)
+            free(h.level);
+        free(sys);
+        free(geometry);
+        free(file_path);
+        return 0;
+    }
+
+    // simulate the levels of a hierarchy, from L1 down
+    if (level_spec != NULL) {
+        int *geometry;
+        int levels = parse_geometries(level_spec, &geometry);
+        if (levels < 0) {
+            printf("Geometry list not valid\n");
+            return 0;
+        }
+        hierarchy_t h;
+        if (init_hierarchy(&h, geometry, levels, &options, inclusion) != 0) {
+            printf("Error in cache creation\n");
+            return 0;
+        }
+        if (simulate_hierarchy(&reader, &h, jobs) != 0) {
+            printf("Error in memory allocation\n");
+            return 0;
+        }
+        if (reader.error) {
+            printf("Error in reading trace %s\n", file_path);
+            return 0;
+        }
+        for (int i = 0; i < levels; i++) {
+            printf("L%d ", i + 1);
+            print_stats_row(&h.level[i]);
+        }
+        close_trace(&reader);
+        free(h.level);
+        free(geometry);
+        free(file_path);
+        return 0;
+    }
+
+    // OPT looks ahead: a first pass finds the next use of every access,
+    // then the trace is read again for the simulation
+    next_use_t uses;
+    memset(&uses, 0, sizeof(uses));
+    if (options.policy == POLICY_OPT) {
+        if (sweep_spec != NULL || reader.fd >= 0) {
+            printf("OPT needs a single cache and a trace file\n");
+            return 0;
+        }
+        if (build_next_use(&reader, b, &uses) != 0) {
+            printf("Error in writing the next-use file\n");
+            return 0;
+        }
+        close_trace(&reader);
+        if (open_trace(&reader, file_path) != 0) {
+            printf("Error in opening trace %s\n", file_path);
+            return 0;
+        }
+    }
+
+    // simulate every geometry of the sweep over one pass of the trace
+    if (sweep_spec != NULL) {
+        int *geometry;
+        int caches = parse_geometries(sweep_spec, &geometry);
+        if (caches < 0) {
+            printf("Geometry list not valid\n");
+            return 0;
+        }
+        cache_t *sweep = calloc((size_t)caches, sizeof(cache_t));
+        for (int i = 0; sweep != NULL && i < caches; i++) {
+            if (init_cache(&sweep[i], geometry[3 * i], geometry[3 * i + 1],
+                           geometry[3 * i + 2], &options) != 0) {
+                printf("Error in cache creation\n");
+                return 0;
+            }
+        }
+        if (sweep == NULL || simulate_sweep(&reader, sweep, caches, jobs)) {
+            printf("Error in starting the sweep\n");
+            return 0;
+        }
+        if (reader.error) {
+            printf("Error in reading trace %s\n", file_path);
+            return 0;
+        }
+        for (int i = 0; i < caches; i++)
+            print_stats_row(&sweep[i]);
+        close_trace(&reader);
+        free(sweep);
+        free(geometry);
+        free(file_path);
+        return 0;
+    }
 
-    while (fscanf(pFile, "%c %lx,%d", &operation, &address, &size) > 0) {
-        unsigned long curr_tag = address >> (s + b);
-        unsigned long curr_set_num = (address << t) >> (b + t);
-        if (t == ADDRESS_BITS)
-            curr_set_num = 0;
-        if (operation == 'L') {
-            count(cache, curr_tag, curr_set_num, 0);
-        } else if (operation == 'S') {
-            count(cache, curr_tag, curr_set_num, 1);
+    // random victims and fills come from one generator, DRRIP followers
+    // read the misses of every leader, Hawkeye shares its predictor and
+    // OPT follows the position of the access in the whole trace, and a
+    // prefetcher fills other sets than the one accessed, so these depend
+    // on the order in which the sets are accessed and the cache is
+    // simulated serially
+    int shared = options.policy == POLICY_RANDOM ||
+                 options.policy == POLICY_BRRIP ||
+                 options.policy == POLICY_DRRIP ||
+                 options.policy == POLICY_OPT ||
+                 options.policy == POLICY_HAWKEYE ||
+                 options.prefetch != PREFETCH_NONE;
+    if (jobs > 1 && !shared) {
+        if (simulate_sharded(&reader, s, E, b, &options, jobs, &cache) != 0) {
+            printf("Error in cache creation\n");
+            return 0;
         }
+    } else {
+        // create cache: the sets and their ways are allocated once
+        if (init_cache(&cache, s, E, b, &options) != 0) {
+            printf("Error in cache creation\n");
+            return 0;
+        }
+        cache.opt_next = uses.next;
+        const trace_record_t *batch;
+        size_t n;
+        while ((n = read_batch(&reader, &batch)) > 0)
+            cache.kernel(&cache, batch, n);
+        free_cache(&cache);
+    }
+    if (reader.error) {
+        printf("Error in reading trace %s\n", file_path);
+        return 0;
     }
-    fclose(pFile);
+    close_trace(&reader);
+    free_next_use(&uses);
     csim_stats_t *stats = malloc(sizeof(csim_stats_t));
-    free_cache(cache);
 
     // write the result into the struct stats
-    stats->misses = (unsigned long)miss;
-    stats->hits = (unsigned long)hit;
-    stats->evictions = (unsigned long)eviction;
-    stats->dirty_evictions = (unsigned long)(dirty_eviction * B);
-    stats->dirty_bytes = (unsigned long)(dirty_count * B);
+    get_stats(&cache, stats);
     printSummary(stats);
+    // the summary format is fixed, the write traffic comes on its own line
+    if (report_writes)
+        printf("bytes_written:%lu\n", write_traffic(&cache));
+    if (options.prefetch != PREFETCH_NONE)
+        print_prefetch(&cache);
 
     // free the memory allocated
     free(stats);
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Run every regression case against a built simulator:
+#   tests/run_tests.sh ./csim
+# A case is <name>.trace, the options in <name>.args and the expected
+# output in <name>.expected.
+csim=${1:?usage: run_tests.sh path/to/csim}
+dir=$(dirname "$0")
+status=0
+for args in "$dir"/*.args; do
+    name=${args%.args}
+    if "$csim" $(cat "$args") -t "$name.trace" | cmp -s - "$name.expected"; then
+        echo "PASS $(basename "$name")"
+    else
+        echo "FAIL $(basename "$name")"
+        status=1
+    fi
+done
+exit $status